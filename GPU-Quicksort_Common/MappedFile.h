@@ -0,0 +1,169 @@
+/*
+Copyright (c) 2014-2019, Intel Corporation
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+* Redistributions of source code must retain the above copyright 
+      notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above 
+      copyright notice, this list of conditions and the following 
+      disclaimer in the documentation and/or other materials provided 
+      with the distribution.
+      * Neither the name of Intel Corporation nor the names of its 
+      contributors may be used to endorse or promote products 
+      derived from this software without specific prior written 
+      permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// MappedFile.h : memory mapping of the files that quicksort-file sorts in place, shared by all the ports.
+//
+// The mapping is the d buffer of GPUQSort (CL_MEM_USE_HOST_PTR / use_host_ptr). The OpenCL ports
+// create that buffer with a size rounded past the next multiple of 64 bytes, so MapFile makes
+// MAPPED_FILE_PADDING bytes past the end of the file readable and writable too. The file keeps its
+// size all along: a crash or a kill while it is mapped never leaves it padded.
+//
+#ifndef MAPPEDFILE_DOT_H
+#define MAPPEDFILE_DOT_H
+
+#include <string.h>
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define MAPPED_FILE_PADDING 64
+
+typedef struct
+{
+	void*				pData;
+	unsigned long long	fileSize;
+	unsigned long long	mappedSize;
+#ifdef _MSC_VER
+	HANDLE				hFile;
+	HANDLE				hMapping;
+	void*				pView;		// the view of the file, when pData is a padded copy of it
+#else
+	int					fd;
+#endif
+} MappedFile;
+
+// Maps pFileName for reading and writing, with MAPPED_FILE_PADDING bytes to spare past its end
+bool MapFile(const char* pFileName, MappedFile* pMapped)
+{
+	memset(pMapped, 0, sizeof(MappedFile));
+#ifdef _MSC_VER
+	pMapped->hFile = CreateFileA(pFileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (pMapped->hFile == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(pMapped->hFile, &size)) {
+		CloseHandle(pMapped->hFile);
+		return false;
+	}
+	pMapped->fileSize = size.QuadPart;
+	if (pMapped->fileSize == 0)
+		return true;
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	const unsigned long long page = si.dwPageSize;
+	pMapped->mappedSize = ((pMapped->fileSize + page - 1)/page)*page;
+	// a mapping of the file's own size: the view ends at the end of the last page
+	pMapped->hMapping = CreateFileMappingA(pMapped->hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+	if (pMapped->hMapping != NULL)
+		pMapped->pView = MapViewOfFile(pMapped->hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (pMapped->pView == NULL) {
+		if (pMapped->hMapping != NULL)
+			CloseHandle(pMapped->hMapping);
+		CloseHandle(pMapped->hFile);
+		return false;
+	}
+	if (pMapped->mappedSize - pMapped->fileSize >= MAPPED_FILE_PADDING) {
+		pMapped->pData = pMapped->pView;
+		pMapped->pView = NULL;
+		return true;
+	}
+	// the padding would run past the view: sort a padded copy, which UnmapFile writes back
+	pMapped->mappedSize += page;
+	pMapped->pData = VirtualAlloc(NULL, (SIZE_T)pMapped->mappedSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (pMapped->pData == NULL) {
+		UnmapViewOfFile(pMapped->pView);
+		CloseHandle(pMapped->hMapping);
+		CloseHandle(pMapped->hFile);
+		return false;
+	}
+	memcpy(pMapped->pData, pMapped->pView, (size_t)pMapped->fileSize);
+#else
+	pMapped->fd = open(pFileName, O_RDWR);
+	if (pMapped->fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(pMapped->fd, &st) != 0) {
+		close(pMapped->fd);
+		return false;
+	}
+	pMapped->fileSize = st.st_size;
+	if (pMapped->fileSize == 0)
+		return true;
+	const unsigned long long page = sysconf(_SC_PAGESIZE);
+	pMapped->mappedSize = ((pMapped->fileSize + MAPPED_FILE_PADDING + page - 1)/page)*page;
+	// reserve the padded size in anonymous memory and map the file over its start: the padding
+	// is the rest of the file's last page, which is never written to the file, or anonymous pages
+	void* pReserved = mmap(NULL, pMapped->mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pReserved == MAP_FAILED) {
+		close(pMapped->fd);
+		return false;
+	}
+	if (mmap(pReserved, pMapped->fileSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pMapped->fd, 0) == MAP_FAILED) {
+		munmap(pReserved, pMapped->mappedSize);
+		close(pMapped->fd);
+		return false;
+	}
+	pMapped->pData = pReserved;
+#endif
+	return true;
+}
+
+// Writes the mapping back to the file and closes it
+bool UnmapFile(MappedFile* pMapped)
+{
+	bool ok = true;
+#ifdef _MSC_VER
+	if (pMapped->pView) {
+		memcpy(pMapped->pView, pMapped->pData, (size_t)pMapped->fileSize);
+		VirtualFree(pMapped->pData, 0, MEM_RELEASE);
+		pMapped->pData = pMapped->pView;
+	}
+	if (pMapped->pData) {
+		ok = FlushViewOfFile(pMapped->pData, 0) != 0;
+		UnmapViewOfFile(pMapped->pData);
+		CloseHandle(pMapped->hMapping);
+	}
+	CloseHandle(pMapped->hFile);
+#else
+	if (pMapped->pData) {
+		ok = msync(pMapped->pData, pMapped->fileSize, MS_SYNC) == 0;
+		munmap(pMapped->pData, pMapped->mappedSize);
+	}
+	ok = close(pMapped->fd) == 0 && ok;
+#endif
+	memset(pMapped, 0, sizeof(MappedFile));
+	return ok;
+}
+
+#endif // MAPPEDFILE_DOT_H
@@ -0,0 +1,282 @@
+/*
+Copyright (c) 2014-2019, Intel Corporation
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+* Redistributions of source code must retain the above copyright 
+      notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above 
+      copyright notice, this list of conditions and the following 
+      disclaimer in the documentation and/or other materials provided 
+      with the distribution.
+      * Neither the name of Intel Corporation nor the names of its 
+      contributors may be used to endorse or promote products 
+      derived from this software without specific prior written 
+      permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// DistributedSortMain.cpp : QuicksortDistributed is a sample sort of P processes, each holding
+// a shard of the data.
+//
+// The processes agree on P-1 splitters from a sample of every shard, send every element to the
+// process whose range holds it (all_to_all), and sort what they receive with GPUQSort, so that
+// the concatenation of the shards in rank order is sorted. The processes talk through a
+// Transport (see Transport.h): here they are forked on one machine and use ShmTransport, and the
+// process which forks them aborts the transport as soon as one of them fails, so that the others
+// do not wait for it forever.
+//
+#include "GPUQSort.h"
+#include "Transport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <random>
+#include <signal.h>
+#include <sys/wait.h>
+
+// samples of every shard that go into the choice of the splitters
+#ifndef DISTRIBUTED_SAMPLES
+#define DISTRIBUTED_SAMPLES 256
+#endif
+
+const char sUsageString[] =
+	"Usage: QuicksortDistributed <num processes> <elements per process> <uint|float|double|ulong> [cpu|gpu] [intel|amd|nvidia]";
+
+// Sorts the shards of all the ranks: on return the shard of rank r holds the r-th range of the
+// sorted data. The shards do not need to be of the same size, before or after.
+template <class T>
+bool DistributedSort(OCLResources* pOCL, Transport* pTransport, std::vector<T>& shard)
+{
+	const int P = pTransport->size();
+	double beginClock, endClock;
+
+	// choose the splitters from a random sample of every shard
+	beginClock = seconds();
+	std::vector<T> samples(DISTRIBUTED_SAMPLES);
+	std::mt19937 gen(pTransport->rank());
+	for(size_t i = 0; i < samples.size(); i++)
+		samples[i] = shard.empty() ? T() : shard[gen() % shard.size()];
+	std::vector<char> all_samples_bytes;
+	if (!pTransport->all_gather(samples.data(), samples.size()*sizeof(T), all_samples_bytes))
+		return false;
+	std::vector<T> all_samples(all_samples_bytes.size()/sizeof(T));
+	memcpy(all_samples.data(), all_samples_bytes.data(), all_samples_bytes.size());
+	std::sort(all_samples.begin(), all_samples.end());
+	std::vector<T> splitters(P - 1);
+	for(int r = 1; r < P; r++)
+		splitters[r-1] = all_samples[r*DISTRIBUTED_SAMPLES];
+
+	// rank r gets the elements between splitters[r-1] and splitters[r]
+	std::vector<uint> dest(shard.size());
+	std::vector<size_t> counts(P, 0), offsets(P, 0);
+	for(size_t i = 0; i < shard.size(); i++) {
+		dest[i] = std::upper_bound(splitters.begin(), splitters.end(), shard[i]) - splitters.begin();
+		counts[dest[i]]++;
+	}
+	for(int r = 1; r < P; r++)
+		offsets[r] = offsets[r-1] + counts[r-1];
+	std::vector<T> send(shard.size());
+	for(size_t i = 0; i < shard.size(); i++)
+		send[offsets[dest[i]]++] = shard[i];
+	endClock = seconds();
+	double partitionTime = endClock - beginClock;
+
+	// exchange the partitions
+	beginClock = seconds();
+	std::vector<size_t> send_bytes(P), recv_bytes;
+	for(int r = 0; r < P; r++)
+		send_bytes[r] = counts[r]*sizeof(T);
+	std::vector<char> recv;
+	if (!pTransport->all_to_all(send.data(), send_bytes, recv, recv_bytes))
+		return false;
+	shard.resize(recv.size()/sizeof(T));
+	memcpy(shard.data(), recv.data(), recv.size());
+	endClock = seconds();
+	double exchangeTime = endClock - beginClock;
+
+	// and sort them
+	beginClock = seconds();
+	if (shard.size() > 1) {
+#ifdef HALF_MEMORY
+		// GPUQSort does not use dn
+		GPUQSort(pOCL, shard.size(), shard.data(), (T*)NULL);
+#else
+		std::vector<T> scratch(shard.size());
+		GPUQSort(pOCL, shard.size(), shard.data(), scratch.data());
+#endif
+	}
+	endClock = seconds();
+	double sortTime = endClock - beginClock;
+
+	std::ostringstream line;
+	line << "rank " << pTransport->rank() << ": " << shard.size() << " elements, partition " 
+	     << partitionTime * 1000 << " ms, exchange " << exchangeTime * 1000 << " ms, sort " 
+	     << sortTime * 1000 << " ms";
+	PrintLine(line.str());
+	return true;
+}
+
+// The shards are sorted when every one of them is, and the last element of every non-empty shard
+// is not greater than the first element of the next non-empty one.
+template <class T>
+bool VerifyDistributedSort(Transport* pTransport, const std::vector<T>& shard, unsigned long long total)
+{
+	struct shard_summary {
+		unsigned long long size;
+		T first, last;
+	} mine = { shard.size(), shard.empty() ? T() : shard.front(), shard.empty() ? T() : shard.back() };
+	std::vector<char> all_bytes;
+	if (!pTransport->all_gather(&mine, sizeof(mine), all_bytes))
+		return false;
+	const shard_summary* all = (const shard_summary*)all_bytes.data();
+
+	bool correct = std::is_sorted(shard.begin(), shard.end());
+	unsigned long long received = 0;
+	const shard_summary* previous = NULL;
+	for(int r = 0; r < pTransport->size(); r++) {
+		received += all[r].size;
+		if (all[r].size == 0)
+			continue;
+		if (previous != NULL && all[r].first < previous->last)
+			correct = false;
+		previous = &all[r];
+	}
+	return correct && received == total;
+}
+
+template <class T>
+int RunRank(OCLResources* pOCL, Transport* pTransport, const std::string& type_name, size_t shard_size)
+{
+	if (!BuildKernels<T>(pOCL, type_name)) {
+		std::cerr << "Failed to build the kernels for type " << type_name << std::endl;
+		pTransport->abort();
+		return -1;
+	}
+
+	// every rank generates its own shard
+	std::vector<T> shard(shard_size);
+	std::mt19937_64 gen(shard_size + pTransport->rank());
+	for(size_t i = 0; i < shard_size; i++)
+		shard[i] = (T)(gen() >> (64 - 8*sizeof(T)));
+
+	double beginClock, endClock;
+	bool ok = pTransport->barrier();
+	beginClock = seconds();
+	ok = ok && DistributedSort(pOCL, pTransport, shard);
+	ok = ok && pTransport->barrier();
+	endClock = seconds();
+	if (!ok) {
+		std::cerr << "rank " << pTransport->rank() << ": the transport failed" << std::endl;
+		pTransport->abort();
+		return -1;
+	}
+
+	bool correct = VerifyDistributedSort(pTransport, shard, (unsigned long long)shard_size*pTransport->size());
+	if (pTransport->rank() == 0) {
+		std::cout << "Time to sort " << (unsigned long long)shard_size*pTransport->size() << " elements of type " 
+		          << type_name << " on " << pTransport->size() << " processes: " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+		std::cout << "verifying: " << std::boolalpha << correct << std::endl;
+	}
+	return correct ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 4 || argc > 6) {
+		std::cerr << sUsageString << std::endl;
+		return -1;
+	}
+	int				num_ranks = atoi(argv[1]);
+	size_t			shard_size = (size_t)strtoull(argv[2], NULL, 10);
+	std::string		type_name = argv[3];
+	const char*		pDeviceStr = argc > 4 ? argv[4] : "gpu";
+	const char*		pVendorStr = argc > 5 ? argv[5] : "intel";
+	if (num_ranks < 1 || (type_name != "uint" && type_name != "float" && type_name != "double" && type_name != "ulong")) {
+		std::cerr << sUsageString << std::endl;
+		return -1;
+	}
+
+	// the ranks are forked before anything touches the SYCL runtime
+	std::string name = "/gpuqsort." + std::to_string(getpid());
+	if (!ShmTransport::Create(name, num_ranks)) {
+		std::cerr << "Failed to create the shared memory transport" << std::endl;
+		return -1;
+	}
+	std::vector<pid_t> children;
+	for(int r = 0; r < num_ranks; r++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			ShmTransport transport;
+			if (!transport.Attach(name, r))
+				_exit(255);
+			OCLResources myOCL;
+			InitOCLResources(&myOCL, pDeviceStr, pVendorStr);
+
+			int ret = -1;
+			if (type_name == "uint")	ret = RunRank<uint>(&myOCL, &transport, type_name, shard_size);
+			if (type_name == "float")	ret = RunRank<float>(&myOCL, &transport, type_name, shard_size);
+			if (type_name == "double")	ret = RunRank<double>(&myOCL, &transport, type_name, shard_size);
+			if (type_name == "ulong")	ret = RunRank<cl_ulong>(&myOCL, &transport, type_name, shard_size);
+			transport.Detach();
+			return ret;
+		}
+		if (pid < 0) {
+			perror("fork");
+			// the ranks already forked wait for this one on the barrier
+			for(size_t c = 0; c < children.size(); c++)
+				kill(children[c], SIGTERM);
+			for(size_t c = 0; c < children.size(); c++)
+				waitpid(children[c], NULL, 0);
+			ShmTransport::Remove(name, num_ranks);
+			return -1;
+		}
+		children.push_back(pid);
+	}
+
+	// A rank which fails, whether it returns an error, exits or crashes, aborts the transport, 
+	// and the ones waiting for it on a barrier fail in turn
+	ShmTransport supervisor;
+	bool attached = supervisor.Attach(name, -1);
+	int ret = 0;
+	for(size_t c = 0; c < children.size(); c++) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			perror("waitpid");
+			ret = -1;
+			break;
+		}
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			continue;
+		// 1 is a wrong result, of a rank which is done with the transport
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 1)
+			ret = ret == 0 ? 1 : ret;
+		else
+			ret = -1;
+		if (attached)
+			supervisor.abort();
+		else
+			for(size_t k = 0; k < children.size(); k++)
+				kill(children[k], SIGTERM);
+	}
+	supervisor.Detach();
+	ShmTransport::Remove(name, num_ranks);
+	return ret;
+}
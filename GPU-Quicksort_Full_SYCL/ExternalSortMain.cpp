@@ -0,0 +1,511 @@
+/*
+Copyright (c) 2014-2019, Intel Corporation
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+* Redistributions of source code must retain the above copyright 
+      notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above 
+      copyright notice, this list of conditions and the following 
+      disclaimer in the documentation and/or other materials provided 
+      with the distribution.
+      * Neither the name of Intel Corporation nor the names of its 
+      contributors may be used to endorse or promote products 
+      derived from this software without specific prior written 
+      permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// ExternalSortMain.cpp : Sorts a binary file of keys that does not fit in device or host memory.
+//
+// The input is cut into chunks sized to the device, every chunk is sorted with GPUQSort and
+// written to the temp directory as a sorted run, and the runs are merged into the output file.
+// The merge is split by key range: splitters are picked from samples of the runs, and every
+// thread k-way merges its own key range of all runs into its own region of the output file.
+// Every run is opened once for the merge, and the threads read it at their own offsets, so the
+// merge keeps as many files open as there are runs, whatever the number of threads.
+//
+#include "GPUQSort.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <queue>
+#include <string>
+#include <future>
+#include <thread>
+#include <mutex>
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <sys/resource.h>
+#endif
+
+// Host memory that the chunk buffers and the merge buffers may take, in bytes
+#ifndef EXTERNAL_SORT_HOST_MEMORY
+#define EXTERNAL_SORT_HOST_MEMORY (2ull << 30)
+#endif
+// Elements sampled from every run to pick the splitters of the merge
+#define EXTERNAL_SORT_SAMPLES_PER_RUN 1024
+// Smallest merge buffer per run, in elements
+#define EXTERNAL_SORT_MIN_MERGE_BUFFER 1024
+
+const char sUsageString[] =
+	"Usage: QuicksortExternal <input> <output> <uint|float|double|ulong> [cpu|gpu] [intel|amd|nvidia] [chunk elements (0 = fit the device)] [temp dir]\n"
+	"       QuicksortExternal --generate <num elements> <output> <uint|float|double|ulong>";
+
+// 64-bit file positioning: the inputs are way past 2 GB
+int SeekFile(FILE* fp, unsigned long long offset)
+{
+#ifdef _MSC_VER
+	return _fseeki64(fp, (__int64)offset, SEEK_SET);
+#else
+	return fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+unsigned long long FileSize(FILE* fp)
+{
+#ifdef _MSC_VER
+	_fseeki64(fp, 0, SEEK_END);
+	unsigned long long size = _ftelli64(fp);
+#else
+	fseeko(fp, 0, SEEK_END);
+	unsigned long long size = ftello(fp);
+#endif
+	SeekFile(fp, 0);
+	return size;
+}
+
+typedef struct
+{
+	std::string fileName;
+	unsigned long long count;
+	// open for the merge (see OpenRun), shared by all the merge threads
+#ifdef _MSC_VER
+	FILE* fp;
+	std::shared_ptr<std::mutex> pLock;
+#else
+	int fd;
+#endif
+} sorted_run;
+
+bool OpenRun(sorted_run& run)
+{
+#ifdef _MSC_VER
+	run.fp = fopen(run.fileName.c_str(), "rb");
+	run.pLock = std::make_shared<std::mutex>();
+	return run.fp != NULL;
+#else
+	run.fd = open(run.fileName.c_str(), O_RDONLY);
+	return run.fd >= 0;
+#endif
+}
+
+// Reads count elements of the run from element first on; safe to call from several threads
+template <class T>
+bool ReadRun(const sorted_run& run, unsigned long long first, T* pBuf, size_t count)
+{
+#ifdef _MSC_VER
+	// no positioned reads: the threads take turns on the one FILE
+	std::lock_guard<std::mutex> lock(*run.pLock);
+	return SeekFile(run.fp, first*sizeof(T)) == 0 && fread(pBuf, sizeof(T), count, run.fp) == count;
+#else
+	char* p = (char*)pBuf;
+	size_t left = count*sizeof(T);
+	off_t offset = (off_t)(first*sizeof(T));
+	while (left > 0) {
+		ssize_t got = pread(run.fd, p, left, offset);
+		if (got <= 0)
+			return false;
+		p += got;
+		left -= got;
+		offset += got;
+	}
+	return true;
+#endif
+}
+
+// Closes and deletes the runs: on success and on every error once the runs exist
+void RemoveRuns(std::vector<sorted_run>& runs)
+{
+	for(auto& run : runs) {
+#ifdef _MSC_VER
+		if (run.fp)
+			fclose(run.fp);
+#else
+		if (run.fd >= 0)
+			close(run.fd);
+#endif
+		remove(run.fileName.c_str());
+	}
+	runs.clear();
+}
+
+// Reads run elements sequentially through a buffer, starting at element start and stopping at end
+template <class T>
+class run_cursor
+{
+	const sorted_run& run;
+	std::vector<T> buf;
+	size_t pos, filled;
+	unsigned long long next, end;
+	bool failed_;
+public:
+	run_cursor(const sorted_run& run_, unsigned long long start, unsigned long long end_, size_t bufferSize)
+		: run(run_), buf(bufferSize), pos(0), filled(0), next(start), end(end_), failed_(false) {}
+
+	// returns false when the range is exhausted or the run could not be read (see failed)
+	bool fill() {
+		if (pos < filled)
+			return true;
+		size_t count = (size_t)std::min((unsigned long long)buf.size(), end - next);
+		if (count == 0)
+			return false;
+		if (!ReadRun(run, next, buf.data(), count)) {
+			std::cerr << "Short read from run " << run.fileName << std::endl;
+			failed_ = true;
+			return false;
+		}
+		filled = count;
+		next += count;
+		pos = 0;
+		return true;
+	}
+	bool failed() const { return failed_; }
+	T value() const { return buf[pos]; }
+	void advance() { pos++; }
+};
+
+// Finds in *pIndex the first element of the run that is not less than key: a binary search on disk
+template <class T>
+bool RunLowerBound(const sorted_run& run, T key, unsigned long long* pIndex)
+{
+	unsigned long long lo = 0, hi = run.count;
+	while (lo < hi) {
+		unsigned long long mid = lo + (hi - lo)/2;
+		T value;
+		if (!ReadRun(run, mid, &value, 1)) {
+			std::cerr << "Failed to read run " << run.fileName << std::endl;
+			return false;
+		}
+		if (value < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pIndex = lo;
+	return true;
+}
+
+// k-way merges the ranges [starts[r], ends[r]) of all runs into the output file at element outOffset
+template <class T>
+bool MergeRange(const std::vector<sorted_run>& runs, const std::vector<unsigned long long>& starts,
+                const std::vector<unsigned long long>& ends, const std::string& outputName,
+                unsigned long long outOffset, size_t bufferSize)
+{
+	typedef std::pair<T, size_t> heap_entry;
+	std::priority_queue<heap_entry, std::vector<heap_entry>, std::greater<heap_entry>> heap;
+	std::vector<run_cursor<T>*> cursors(runs.size());
+	bool ok = true;
+	for(size_t r = 0; r < runs.size(); r++) {
+		cursors[r] = new run_cursor<T>(runs[r], starts[r], ends[r], bufferSize);
+		if (cursors[r]->fill())
+			heap.push(heap_entry(cursors[r]->value(), r));
+		ok = ok && !cursors[r]->failed();
+	}
+
+	FILE* out = fopen(outputName.c_str(), "r+b");
+	ok = ok && out != NULL && SeekFile(out, outOffset*sizeof(T)) == 0;
+	std::vector<T> outBuf;
+	outBuf.reserve(bufferSize);
+	while (ok && !heap.empty()) {
+		heap_entry top = heap.top();
+		heap.pop();
+		outBuf.push_back(top.first);
+		if (outBuf.size() == bufferSize) {
+			// a short write, e.g. on a full disk, ends the merge
+			if (fwrite(outBuf.data(), sizeof(T), outBuf.size(), out) != outBuf.size()) {
+				ok = false;
+				break;
+			}
+			outBuf.clear();
+		}
+		run_cursor<T>* c = cursors[top.second];
+		c->advance();
+		if (c->fill())
+			heap.push(heap_entry(c->value(), top.second));
+		ok = ok && !c->failed();
+	}
+	if (ok && !outBuf.empty())
+		ok = fwrite(outBuf.data(), sizeof(T), outBuf.size(), out) == outBuf.size();
+	if (out)
+		ok = fclose(out) == 0 && ok;
+
+	for(size_t r = 0; r < runs.size(); r++)
+		delete cursors[r];
+	return ok;
+}
+
+// Largest chunk that the device can sort in one go (the data plus its scratch copy and the records)
+// and that fits the host buffers: the chunk being sorted, the one being read ahead and the scratch copy.
+template <class T>
+size_t DeviceChunkSize(OCLResources* pOCL)
+{
+	device dev = pOCL->queue.get_device();
+	unsigned long long maxAlloc = dev.get_info<info::device::max_mem_alloc_size>();
+	unsigned long long globalMem = dev.get_info<info::device::global_mem_size>();
+	unsigned long long chunk = std::min(maxAlloc/sizeof(T), (globalMem/4*3)/(2*sizeof(T)));
+	chunk = std::min(chunk, (unsigned long long)EXTERNAL_SORT_HOST_MEMORY/(3*sizeof(T)));
+	// GPUQSort indexes with uint
+	chunk = std::min(chunk, (unsigned long long)(1u << 31));
+	return (size_t)chunk;
+}
+
+template <class T>
+int ExternalSort(OCLResources* pOCL, const std::string& inputName, const std::string& outputName,
+                 const std::string& type_name, size_t chunkSize, const std::string& tempDir)
+{
+	double beginClock, endClock, totalClock = seconds();
+
+	if (!BuildKernels<T>(pOCL, type_name)) {
+		std::cerr << "Failed to build the kernels for type " << type_name << std::endl;
+		return -1;
+	}
+
+	FILE* in = fopen(inputName.c_str(), "rb");
+	if (in == NULL) {
+		std::cerr << "Failed to open " << inputName << std::endl;
+		return -1;
+	}
+	unsigned long long fileSize = FileSize(in);
+	// the output would silently lose the trailing bytes
+	if (fileSize % sizeof(T) != 0) {
+		std::cerr << inputName << " holds " << fileSize << " bytes, not a whole number of " 
+		          << type_name << " elements" << std::endl;
+		fclose(in);
+		return -1;
+	}
+	unsigned long long total = fileSize/sizeof(T);
+	if (chunkSize == 0)
+		chunkSize = DeviceChunkSize<T>(pOCL);
+	chunkSize = (size_t)std::max(std::min((unsigned long long)chunkSize, total), 1ull);
+	std::cout << "Sorting " << total << " elements of type " << type_name << " in chunks of " << chunkSize << std::endl;
+
+	// Phase 1: sorted runs. The next chunk is read while the current one is sorted.
+	beginClock = seconds();
+	std::vector<sorted_run> runs;
+	std::vector<T> samples;
+	std::vector<T> chunk(chunkSize), nextChunk(chunkSize);
+#ifdef HALF_MEMORY
+	std::vector<T> scratch;
+#else
+	std::vector<T> scratch(chunkSize);
+#endif
+	auto readChunk = [in, chunkSize](T* pChunk) { return fread(pChunk, sizeof(T), chunkSize, in); };
+	size_t n = readChunk(chunk.data());
+	while (n > 0) {
+		std::future<size_t> nextRead = std::async(std::launch::async, readChunk, nextChunk.data());
+
+		// not worth the trip to the device
+		if (n < QUICKSORT_BLOCK_SIZE)
+			std::sort(chunk.begin(), chunk.begin() + n);
+		else
+			GPUQSort(pOCL, n, chunk.data(), scratch.data());
+
+		char pRunName[64];
+#ifdef _MSC_VER
+		sprintf(pRunName, "QuicksortExternal-%u-%u.run", (unsigned)GetCurrentProcessId(), (unsigned)runs.size());
+#else
+		sprintf(pRunName, "QuicksortExternal-%u-%u.run", (unsigned)getpid(), (unsigned)runs.size());
+#endif
+		sorted_run run;
+		run.fileName = tempDir + "/" + pRunName;
+		run.count = n;
+#ifdef _MSC_VER
+		run.fp = NULL;
+#else
+		run.fd = -1;
+#endif
+		FILE* fp = fopen(run.fileName.c_str(), "wb");
+		if (fp != NULL)
+			runs.push_back(run);
+		bool written = fp != NULL && fwrite(chunk.data(), sizeof(T), n, fp) == n;
+		if (fp != NULL)
+			written = fclose(fp) == 0 && written;
+		if (!written) {
+			std::cerr << "Failed to write run " << run.fileName << std::endl;
+			nextRead.wait();
+			fclose(in);
+			RemoveRuns(runs);
+			return -1;
+		}
+
+		size_t step = std::max(n/EXTERNAL_SORT_SAMPLES_PER_RUN, (size_t)1);
+		for(size_t i = step/2; i < n; i += step)
+			samples.push_back(chunk[i]);
+
+		n = nextRead.get();
+		std::swap(chunk, nextChunk);
+	}
+	// a read error ends the chunks early, like the end of the file
+	if (ferror(in)) {
+		std::cerr << "Failed to read " << inputName << std::endl;
+		fclose(in);
+		RemoveRuns(runs);
+		return -1;
+	}
+	fclose(in);
+	// the chunk buffers are not needed anymore: give their memory to the merge
+	std::vector<T>().swap(chunk);
+	std::vector<T>().swap(nextChunk);
+	std::vector<T>().swap(scratch);
+	endClock = seconds();
+	std::cout << "Time to sort " << runs.size() << " runs: " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+
+	// Phase 2: split the key range with the samples and merge every range on its own thread
+	beginClock = seconds();
+	// every run stays open during the merge: allow as many open files as the system does
+#ifdef _MSC_VER
+	_setmaxstdio(8192);
+#else
+	struct rlimit fileLimit;
+	if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max) {
+		fileLimit.rlim_cur = fileLimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fileLimit);
+	}
+#endif
+	for(auto& run : runs) {
+		if (!OpenRun(run)) {
+			std::cerr << "Failed to open run " << run.fileName << " of " << runs.size() 
+			          << ": raise the open file limit or the chunk size" << std::endl;
+			RemoveRuns(runs);
+			return -1;
+		}
+	}
+	size_t numRanges = std::max(std::thread::hardware_concurrency(), 1u);
+	std::sort(samples.begin(), samples.end());
+	std::vector<T> splitters;
+	for(size_t p = 1; p < numRanges && !samples.empty(); p++)
+		splitters.push_back(samples[p*samples.size()/numRanges]);
+	splitters.erase(std::unique(splitters.begin(), splitters.end()), splitters.end());
+	numRanges = splitters.size() + 1;
+
+	// bounds[p][r]: first element of run r that belongs to range p
+	std::vector<std::vector<unsigned long long>> bounds(numRanges + 1, std::vector<unsigned long long>(runs.size(), 0));
+	for(size_t r = 0; r < runs.size(); r++) {
+		for(size_t p = 1; p < numRanges; p++) {
+			if (!RunLowerBound(runs[r], splitters[p-1], &bounds[p][r])) {
+				RemoveRuns(runs);
+				return -1;
+			}
+		}
+		bounds[numRanges][r] = runs[r].count;
+	}
+
+	FILE* out = fopen(outputName.c_str(), "wb");
+	if (out == NULL) {
+		std::cerr << "Failed to create " << outputName << std::endl;
+		RemoveRuns(runs);
+		return -1;
+	}
+	fclose(out);
+
+	size_t bufferSize = std::max((size_t)(EXTERNAL_SORT_HOST_MEMORY/(numRanges*(runs.size() + 1)*sizeof(T))), (size_t)EXTERNAL_SORT_MIN_MERGE_BUFFER);
+	std::vector<std::future<bool>> merges;
+	unsigned long long outOffset = 0;
+	for(size_t p = 0; p < numRanges; p++) {
+		merges.push_back(std::async(std::launch::async, MergeRange<T>, std::cref(runs), std::cref(bounds[p]),
+		                            std::cref(bounds[p+1]), std::cref(outputName), outOffset, bufferSize));
+		for(size_t r = 0; r < runs.size(); r++)
+			outOffset += bounds[p+1][r] - bounds[p][r];
+	}
+	bool merged = true;
+	for(auto& m : merges)
+		merged = m.get() && merged;
+	const size_t numRuns = runs.size();
+	RemoveRuns(runs);
+	if (!merged) {
+		std::cerr << "Failed to write " << outputName << std::endl;
+		return -1;
+	}
+	endClock = seconds();
+	std::cout << "Time to merge " << numRuns << " runs on " << numRanges << " threads: " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+	std::cout << "Total time: " << (endClock - totalClock) * 1000 << " ms" << std::endl;
+
+#ifdef TRUST_BUT_VERIFY
+	{
+		std::cout << "verifying: ";
+		FILE* fp = fopen(outputName.c_str(), "rb");
+		std::vector<T> buf(EXTERNAL_SORT_SAMPLES_PER_RUN*EXTERNAL_SORT_MIN_MERGE_BUFFER);
+		unsigned long long count = 0;
+		bool correct = fp != NULL;
+		T last = T();
+		size_t got;
+		while (correct && (got = fread(buf.data(), sizeof(T), buf.size(), fp)) > 0) {
+			if (count > 0 && buf[0] < last)
+				correct = false;
+			correct = correct && std::is_sorted(buf.begin(), buf.begin() + got);
+			last = buf[got - 1];
+			count += got;
+		}
+		if (fp)
+			fclose(fp);
+		correct = correct && count == total;
+		std::cout << std::boolalpha << correct << std::endl;
+		if (!correct)
+			return 1;
+	}
+#endif
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc == 5 && std::string(argv[1]) == "--generate") {
+		unsigned long long num = strtoull(argv[2], NULL, 10);
+		std::string type_name = argv[4];
+		if (type_name == "uint")	return GenerateKeyFile<uint>(num, argv[3]);
+		if (type_name == "float")	return GenerateKeyFile<float>(num, argv[3]);
+		if (type_name == "double")	return GenerateKeyFile<double>(num, argv[3]);
+		if (type_name == "ulong")	return GenerateKeyFile<cl_ulong>(num, argv[3]);
+		std::cerr << sUsageString << std::endl;
+		return -1;
+	}
+	if (argc < 4 || argc > 8) {
+		std::cerr << sUsageString << std::endl;
+		return -1;
+	}
+
+	OCLResources	myOCL;
+	std::string		inputName = argv[1];
+	std::string		outputName = argv[2];
+	std::string		type_name = argv[3];
+	const char*		pDeviceStr = argc > 4 ? argv[4] : "gpu";
+	const char*		pVendorStr = argc > 5 ? argv[5] : "intel";
+	size_t			chunkSize = argc > 6 ? (size_t)strtoull(argv[6], NULL, 10) : 0;
+	std::string		tempDir = argc > 7 ? argv[7] : ".";
+
+	InitOCLResources(&myOCL, pDeviceStr, pVendorStr);
+
+	if (type_name == "uint")	return ExternalSort<uint>(&myOCL, inputName, outputName, type_name, chunkSize, tempDir);
+	if (type_name == "float")	return ExternalSort<float>(&myOCL, inputName, outputName, type_name, chunkSize, tempDir);
+	if (type_name == "double")	return ExternalSort<double>(&myOCL, inputName, outputName, type_name, chunkSize, tempDir);
+	if (type_name == "ulong")	return ExternalSort<cl_ulong>(&myOCL, inputName, outputName, type_name, chunkSize, tempDir);
+	std::cerr << sUsageString << std::endl;
+	return -1;
+}
@@ -0,0 +1,2313 @@
+/*
+Copyright (c) 2014-2019, Intel Corporation
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+* Redistributions of source code must retain the above copyright 
+      notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above 
+      copyright notice, this list of conditions and the following 
+      disclaimer in the documentation and/or other materials provided 
+      with the distribution.
+      * Neither the name of Intel Corporation nor the names of its 
+      contributors may be used to endorse or promote products 
+      derived from this software without specific prior written 
+      permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// GPUQSort.h : SYCL kernels and host code of GPU-Quicksort, shared by the Quicksort executables.
+//
+#ifndef GPUQSORT_DOT_H
+#define GPUQSORT_DOT_H
+
+#include <CL/sycl.hpp>
+
+#include <stdio.h>
+#ifdef _MSC_VER
+// Windows
+#include <windows.h>
+#else
+// Linux
+#include <time.h>
+#include <unistd.h>
+#endif
+#include "OpenCLUtils.h"
+#include <math.h>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <utility>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <random>
+
+#include "tbb/parallel_sort.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/parallel_scan.h"
+#include "tbb/blocked_range.h"
+#include "tbb/task_group.h"
+using namespace cl::sycl;
+
+/* Classes can inherit from the device_selector class to allow users
+ * to dictate the criteria for choosing a device from those that might be
+ * present on a system. This example looks for a device with SPIR support
+ * and prefers GPUs over CPUs. */
+class intel_gpu_selector : public device_selector {
+ public:
+  intel_gpu_selector() : device_selector() {}
+
+  /* The selection is performed via the () operator in the base
+   * selector class.This method will be called once per device in each
+   * platform. Note that all platforms are evaluated whenever there is
+   * a device selection. */
+  int operator()(const device& device) const override {
+    /* We only give a valid score to devices that support SPIR. */
+    //if (device.has_extension(cl::sycl::string_class("cl_khr_spir"))) {
+    if (device.get_info<info::device::name>().find("Intel") != std::string::npos) {
+      if (device.get_info<info::device::device_type>() ==
+          info::device_type::gpu) {
+        return 50;
+      }
+    }
+    /* Devices with a negative score will never be chosen. */
+    return -1;
+  }
+};
+
+// Types:
+#ifdef min
+#undef min
+#endif
+#ifdef max
+#undef max
+#endif
+
+/// return a timestamp with sub-second precision 
+/** QueryPerformanceCounter and clock_gettime have an undefined starting point (null/zero)     
+ *  and can wrap around, i.e. be nulled again. **/ 
+double seconds() { 
+#ifdef _MSC_VER   
+  static LARGE_INTEGER frequency;   
+  if (frequency.QuadPart == 0)     ::QueryPerformanceFrequency(&frequency);   
+  LARGE_INTEGER now;   
+  ::QueryPerformanceCounter(&now);   
+  return now.QuadPart / double(frequency.QuadPart); 
+#else   
+  struct timespec now;   
+  clock_gettime(CLOCK_MONOTONIC, &now);   
+  return now.tv_sec + now.tv_nsec / 1000000000.0; 
+#endif 
+}
+ 
+typedef struct
+{	
+	// CL platform handles:
+	cl_device_id		deviceID;
+	cl_context			contextHdl;
+	cl_program			programHdl;
+	cl_command_queue	cmdQHdl;
+	cl::sycl::queue     queue;
+} OCLResources;
+
+// Creates the queue for the device selected by pDeviceStr ("cpu" or "gpu") and pVendorStr
+// ("intel" or anything else for the default device) and retrieves its OpenCL handles.
+void InitOCLResources(OCLResources* pOCL, const char* pDeviceStr, const char* pVendorStr)
+{
+  auto get_queue = [&pDeviceStr, &pVendorStr]() {  
+    device_selector* pds = 0;
+    if (pVendorStr == std::string("intel")) {
+      if (pDeviceStr == std::string("gpu")) {
+          static intel_gpu_selector selector;
+		  pds = &selector;
+	  } else if (pDeviceStr == std::string("cpu")) {
+		  static cpu_selector selector;
+		  pds = &selector;
+	  }
+	} else {
+		static default_selector selector;
+		pds = &selector;
+	}
+
+    device d(*pds);
+
+    queue queue(*pds, [](cl::sycl::exception_list l) {
+      for (auto ep : l) {
+        try {
+          std::rethrow_exception(ep);
+        } catch (cl::sycl::exception& e) {
+          std::cout << e.what() << std::endl;
+        }
+      }
+    });
+    return queue;
+  };
+  
+  auto queue = get_queue();
+  pOCL->queue = queue;
+  /* Retrieve the underlying cl_context of the context associated with the
+   * queue. */
+  pOCL->contextHdl = queue.get_context().get();
+
+  /* Retrieve the underlying cl_device_id of the device asscociated with the
+   * queue. */
+  pOCL->deviceID = queue.get_device().get();
+
+  /* Retrieve the underlying cl_command_queue of the queue. */
+  pOCL->cmdQHdl = queue.get();
+}
+
+//#define GET_DETAILED_PERFORMANCE 1
+#define HOST 1
+#include "Quicksort.h"
+
+// With USE_USM the kernels get raw USM pointers in place of buffer accessors;
+// global_pointer gives a global_ptr for either one.
+template <class T>
+global_ptr<T> global_pointer(T* p) {
+	return global_ptr<T>(p);
+}
+
+template <class T, access::mode mode>
+global_ptr<T> global_pointer(const accessor<T, 1, mode, access::target::global_buffer>& a) {
+	return a.get_pointer();
+}
+
+#ifdef SUB_GROUP_PARTITION
+// Writing pass of a partition done by a whole sub-group: on each pass its work items
+// read consecutive elements of s[first, end) and the sub-group scans place the smaller
+// and the larger ones next to each other at sn[lfrom] and sn[gfrom], in place of the
+// scattered, per work item sn[lfrom++] = tmp. lfrom and gfrom are the places of the
+// sub-group, the same in all its work items.
+template <class T, class P>
+void sub_group_partition(const sub_group& sg, P s, P sn, uint first, uint end, uint stride, 
+                         T pivot, uint lfrom, uint gfrom) {
+	const uint sglid = sg.get_local_id()[0];
+	for (uint i = first; i < end; i += stride) {
+		T tmp = pivot;
+		if (i + sglid < end)
+			tmp = s[i + sglid];
+		const uint ltp = tmp < pivot, gtp = tmp > pivot;
+		const uint lpos = exclusive_scan_over_group(sg, ltp, plus<uint>());
+		const uint gpos = exclusive_scan_over_group(sg, gtp, plus<uint>());
+		if (ltp)
+			sn[lfrom + lpos] = tmp;
+		if (gtp)
+			sn[gfrom + gpos] = tmp;
+		lfrom += reduce_over_group(sg, ltp, plus<uint>());
+		gfrom += reduce_over_group(sg, gtp, plus<uint>());
+	}
+}
+#endif
+
+// record to push start of the sequence, end of the sequence and direction of sorting on internal stack
+struct workstack_record {
+	uint start;
+	uint end;
+	uint direction;
+};
+
+//---------------------------------------------------------------------------------------
+// Class implements the last stage of GPU-Quicksort, when all the subsequences are small
+// enough to be processed in local memory. It uses similar algorithm to gqsort_kernel to 
+// move items around the pivot and then switches to bitonic sort for sequences in
+// the range [1, THRESHOLD] 
+//
+// d - input array
+// dn - scratch array of the same size as the input array
+// seqs - array of records to be sorted in a local memory.
+// cursors - counters of the sequences taken: the work groups stay resident and each one takes
+//           the next sequence from cursors[bin] until all the count sequences are taken.
+//
+// The class is specialized for a size class of sequences: work groups of WG work items
+// sort sequences of up to BLOCK elements, and the bitonic sort takes THRESHOLD = 2*WG.
+//---------------------------------------------------------------------------------------
+template <class T, uint WG = LQSORT_LOCAL_WORKGROUP_SIZE, uint BLOCK = QUICKSORT_BLOCK_SIZE>
+class lqsort_kernel_class {
+	public:
+    static cl::sycl::kernel* kernel;
+    static const uint WORKGROUP_SIZE = WG;
+    static const uint BLOCK_SIZE = BLOCK;
+    static const uint THRESHOLD = 2*WG;
+
+#ifdef USE_USM
+	using discard_read_write_accessor = T*;
+	using seqs_read_accessor = const work_record<T>*;
+	using cursors_read_write_accessor = uint*;
+#else
+	using discard_read_write_accessor = 
+	  accessor<T, 1, access::mode::discard_read_write, access::target::global_buffer>;
+	using seqs_read_accessor = accessor<work_record<T>, 1, access::mode::read, access::target::global_buffer>;
+	using cursors_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::global_buffer>;
+#endif
+	
+    using local_uint_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::local>;
+    using local_int_read_write_accessor = accessor<int, 1, access::mode::read_write, access::target::local>;
+    using local_T_read_write_accessor = accessor<T, 1, access::mode::read_write, access::target::local>;
+    using local_workstack_record_read_write_accessor = accessor<workstack_record, 1, access::mode::read_write, access::target::local>;
+
+    lqsort_kernel_class(discard_read_write_accessor db,
+	                    discard_read_write_accessor dnb, 
+						seqs_read_accessor seqsb,
+						uint firstb,
+						uint countb,
+						cursors_read_write_accessor cursorsb,
+						uint binb,
+						local_workstack_record_read_write_accessor workstackb,
+						local_int_read_write_accessor workstack_pointerb,
+						local_T_read_write_accessor mysb, 
+						local_T_read_write_accessor mysnb, 
+						local_T_read_write_accessor tempb) :
+						d(db), dn(dnb), seqs(seqsb), first(firstb), count(countb), 
+						cursors(cursorsb), bin(binb),
+						workstack(workstackb),
+						workstack_pointer(workstack_pointerb),
+						mys(mysb), mysn(mysnb), temp(tempb)
+						 {}
+
+    /// step_barrier: barrier between the steps j and next of the bitonic network. The elements
+    /// of a step j <= S are shared by j neighbouring work items only, which are in one sub-group
+    /// of S work items, so such steps need only a sub-group barrier.
+    void step_barrier(nd_item<1> id, uint j, uint next)
+    {
+    	auto sg = id.get_sub_group();
+    	const uint S = sg.get_max_local_range()[0];
+    	if (j <= S && next <= S) {
+    		group_barrier(sg);
+    	} else {
+		    id.barrier(access::fence_space::local_space);
+    	}
+    }
+
+    /// bitonic_sort: sort 2*LOCAL_THREADCOUNT elements
+    void bitonic_sort(local_ptr<T> sh_data, const uint localid, nd_item<1> id)
+    {
+    	for (uint ulevel = 1; ulevel < WG; ulevel <<= 1) {
+            for (uint j = ulevel; j > 0; j >>= 1) {
+                uint pos = 2*localid - (localid & (j - 1));
+    
+    			uint direction = localid & ulevel;
+    			T av = sh_data[pos], bv = sh_data[pos + j];
+    			const typename select_type_selector<T>::data_t sortThem = av > bv;
+    			const T greater = cl::sycl::select(bv, av, sortThem);
+    			const T lesser  = cl::sycl::select(av, bv, sortThem);
+    
+    			sh_data[pos]     = cl::sycl::select(lesser, greater, typename select_type_selector<T>::data_t(direction));
+    			sh_data[pos + j] = cl::sycl::select(greater, lesser, typename select_type_selector<T>::data_t(direction));
+				step_barrier(id, j, j > 1 ? j >> 1 : ulevel << 1);
+            }
+        }
+    
+    	for (uint j = WG; j > 0; j >>= 1) {
+            uint pos = 2*localid - (localid & (j - 1));
+    
+    		T av = sh_data[pos], bv = sh_data[pos + j];
+    		const typename select_type_selector<T>::data_t sortThem = av > bv;
+    		sh_data[pos]      = cl::sycl::select(av, bv, sortThem);
+    		sh_data[pos + j]  = cl::sycl::select(bv, av, sortThem);
+    
+		    // the sorted elements are read by other work items after the last step
+		    step_barrier(id, j, j > 1 ? j >> 1 : 2*WG);
+        }
+    }
+
+    /// sub_group_sort: sort the R*S elements held in registers by a sub-group of S work items,
+    /// element e in v[e / S] of work item e % S. Compare-exchanges within a work item are selects
+    /// and those between work items are sub-group shuffles, so the network needs no barriers.
+    template <uint R>
+    static void sub_group_sort(const sub_group& sg, T (&v)[R])
+    {
+    	const uint S = sg.get_max_local_range()[0];
+    	const uint lane = sg.get_local_id()[0];
+    	for (uint k = 2; k <= R*S; k <<= 1) {
+    		for (uint j = k >> 1; j > 0; j >>= 1) {
+    			if (j >= S) {
+    				const uint rj = j / S;
+#pragma unroll
+    				for (uint r = 0; r < R; r++) {
+    					if (r & rj) 
+    						continue;
+    					const bool up = ((r*S + lane) & k) == 0;
+    					const T a = v[r], b = v[r | rj];
+    					const bool swap = up ? b < a : a < b;
+    					v[r]      = swap ? b : a;
+    					v[r | rj] = swap ? a : b;
+    				}
+    			} else {
+#pragma unroll
+    				for (uint r = 0; r < R; r++) {
+    					const T o = permute_group_by_xor(sg, v[r], j);
+    					const bool up = ((r*S + lane) & k) == 0;
+    					const bool lower = (lane & j) == 0;
+    					v[r] = (up == lower) ? (o < v[r] ? o : v[r]) : (v[r] < o ? o : v[r]);
+    				}
+    			}
+    		}
+    	}
+    }
+
+    /// sub_group_sort_threshold: sort the tsum <= R*S elements of data_in[start, start + tsum)
+    /// with sub_group_sort and write them to data_out
+    template <uint R>
+    static void sub_group_sort_threshold(const sub_group& sg, local_ptr<T> data_in, global_ptr<T> data_out,
+                                         uint start, uint tsum)
+    {
+    	const uint S = sg.get_max_local_range()[0];
+    	const uint lane = sg.get_local_id()[0];
+    	T v[R];
+#pragma unroll
+    	for (uint r = 0; r < R; r++) {
+    		v[r] = std::numeric_limits<T>::max();
+    		if (r*S + lane < tsum) 
+    			v[r] = data_in[start + r*S + lane];
+    	}
+    	sub_group_sort<R>(sg, v);
+#pragma unroll
+    	for (uint r = 0; r < R; r++) {
+    		if (r*S + lane < tsum) 
+    			data_out[start + r*S + lane] = v[r];
+    	}
+    }
+
+    void sort_threshold(local_ptr<T> data_in, 
+	                    global_ptr<T> data_out,
+    					uint start, 
+    					uint end, local_ptr<T> temp_, uint localid,
+						nd_item<1> id) 
+    {
+    	uint tsum = end - start;
+    	auto sg = id.get_sub_group();
+    	const uint S = sg.get_max_local_range()[0];
+    	if (tsum > 1 && tsum <= 2*S) {
+    		// a short sequence is sorted by the first sub-group in registers
+    		if (sg.get_group_id()[0] == 0) {
+    			if (tsum <= S) {
+    				sub_group_sort_threshold<1>(sg, data_in, data_out, start, tsum);
+    			} else {
+    				sub_group_sort_threshold<2>(sg, data_in, data_out, start, tsum);
+    			}
+    		}
+    	} else if (tsum == THRESHOLD) {
+    		bitonic_sort(data_in+start, localid, id);
+    		for (uint i = localid; i < THRESHOLD; i += WG) {
+    			data_out[start + i] = data_in[start + i];
+    		}
+    	} else if (tsum > 1) {
+    		for (uint i = localid; i < THRESHOLD; i += WG) {
+    			if (i < tsum) {
+    				temp_[i] = data_in[start + i];
+    			} else {
+    				temp_[i] = std::numeric_limits<T>::max();
+    			}
+    		}
+		    id.barrier(access::fence_space::local_space);
+    		bitonic_sort(temp_, localid, id);
+    
+    		for (uint i = localid; i < tsum; i += WG) {
+    			data_out[start + i] = temp_[i];
+    		}
+    	} else if (tsum == 1 && localid == 0) {
+    		data_out[start] = data_in[start];
+    	} 
+    }
+
+#define PUSH(START, END) 			if (localid == 0) { \
+										workstack_pointer[0] ++; \
+                                        workstack_record wr{ (START), (END), direction ^ 1 }; \
+										workstack[workstack_pointer[0]] = wr; \
+									} \
+									id.barrier(access::fence_space::local_space);
+
+
+    void operator()(nd_item<1> id) {
+        const size_t localid = id.get_local_id(0);
+		auto g = id.get_group();
+
+		for (;;) {
+			// the work group is done with its last sequence before it takes the next one
+			id.barrier(access::fence_space::local_space);
+		    uint seq = 0;
+			if (localid == 0) {
+				auto cursor_a = cl::sycl::atomic<uint>(multi_ptr<uint, access::address_space::global_space>(&cursors[bin]));
+		    	seq = cl::sycl::atomic_fetch_add(cursor_a, (uint)1);
+			}
+			seq = group_broadcast(g, seq);
+			if (seq >= count)
+				return;
+			sort_sequence(seqs[first + seq], localid, id);
+		}
+	}
+
+	// sorts the sequence of block in local memory and writes it to d
+    void sort_sequence(const work_record<T>& block, const size_t localid, nd_item<1> id) {
+        local_ptr<T> s, sn;
+	    uint i, ltp, gtp;
+		T tmp;
+	
+    	const uint d_offset = block.start;
+    	uint start = 0; 
+    	uint end   = block.end - d_offset;
+    
+    	uint direction = 1; // which direction to sort
+    	// initialize workstack and workstack_pointer: push the initial sequence on the stack
+    	if (localid == 0) {
+    		workstack_pointer[0] = 0; // beginning of the stack
+    		workstack_record wr{ start, end, direction };
+    		workstack[0] = wr;
+    	}
+    	// copy block of data to be sorted by one workgroup into local memory
+    	// note that indeces of local data go from 0 to end-start-1
+    	if (block.direction == 1) {
+    		for (i = localid; i < end; i += WG) {
+    			mys[i] = d[i+d_offset];
+    		}
+    	} else {
+    		for (i = localid; i < end; i += WG) {
+    			mys[i] = dn[i+d_offset];
+    		}
+    	}
+		id.barrier(access::fence_space::local_space);
+
+		// a sequence that the bitonic sort takes in one go needs no partitioning
+		if (end <= THRESHOLD) {
+			sort_threshold(mys.get_pointer(), global_pointer(d) + d_offset, start, end, temp.get_pointer(), localid, id);
+			return;
+		}
+
+        while (workstack_pointer[0] >= 0) { 
+    		// pop up the stack
+    		workstack_record wr = workstack[workstack_pointer[0]];
+    		start = wr.start;
+    		end = wr.end;
+    		direction = wr.direction;
+    		// all the work items have read the top of the stack before it is popped
+		    id.barrier(access::fence_space::local_space);
+    		if (localid == 0) {
+    			workstack_pointer[0] --;
+    		}
+    		if (direction == 1) {
+    			s = mys.get_pointer();
+    			sn = mysn.get_pointer();
+    		} else {
+    			s = mysn.get_pointer();
+    			sn = mys.get_pointer();
+    		}
+    		// Set thread local counters to zero
+    		ltp = gtp = 0;
+		    id.barrier(access::fence_space::local_space);
+    
+    		// Pick a pivot
+    		T pivot = s[start];
+    		if (start < end) {
+    			pivot = median_select(pivot, s[(start+end) >> 1], s[end-1]);
+    		}
+    		// Align work item accesses for coalesced reads.
+    		// Go through data...
+    		for(i = start + localid; i < end; i += WG) {
+    			tmp = s[i];
+    			// counting elements that are smaller ...
+    			if (tmp < pivot)
+    				ltp++;
+    			// or larger compared to the pivot.
+    			if (tmp > pivot) 
+    				gtp++;
+    		}
+    		
+    		// calculate cumulative sums with the group scans
+    		auto g = id.get_group();
+    		const uint ltsum = reduce_over_group(g, ltp, plus<uint>());
+    		const uint gtsum = reduce_over_group(g, gtp, plus<uint>());
+    
+    		// Allocate locations for work items
+    		uint lfrom = start + exclusive_scan_over_group(g, ltp, plus<uint>());
+    		uint gfrom = end - gtsum + exclusive_scan_over_group(g, gtp, plus<uint>());
+    
+    		// go thru data again writing elements to their correct position
+#ifdef SUB_GROUP_PARTITION
+    		auto sg = id.get_sub_group();
+    		sub_group_partition(sg, s, sn, start + (uint)localid - sg.get_local_id()[0], end, WG,
+    		                    pivot, group_broadcast(sg, lfrom), group_broadcast(sg, gfrom));
+#else
+    		for (i = start + localid; i < end; i += WG) {
+    			tmp = s[i];
+    			// increment counts
+    			if (tmp < pivot) 
+    				sn[lfrom++] = tmp;
+    			
+    			if (tmp > pivot) 
+    				sn[gfrom++] = tmp;
+    		}
+#endif
+		    id.barrier(access::fence_space::local_space);
+    
+    		// Store the pivot value between the new sequences
+    		for (i = start + ltsum + localid;i < end - gtsum; i += WG) {
+    			d[i+d_offset] = pivot;
+    		}
+		    id.barrier(access::fence_space::global_and_local);
+    
+    		// if the sequence is shorter than THRESHOLD
+    		// sort it using an alternative sort and place result in d
+    		if (ltsum <= THRESHOLD) {
+    			sort_threshold(sn, global_pointer(d) + d_offset, start, start + ltsum, temp.get_pointer(), localid, id);
+    		} else {
+    			PUSH(start, start + ltsum)
+    		}
+    		
+    		if (gtsum <= THRESHOLD) {
+    			sort_threshold(sn, global_pointer(d) + d_offset, end - gtsum, end, temp.get_pointer(), localid, id);
+    		} else {
+    			PUSH(end - gtsum, end)
+    		}
+    	}
+	}
+
+	private:
+    discard_read_write_accessor d, dn;
+	seqs_read_accessor seqs;
+	uint first, count;
+	cursors_read_write_accessor cursors;
+	uint bin;
+
+    local_workstack_record_read_write_accessor workstack;
+	local_int_read_write_accessor workstack_pointer;
+	
+	local_T_read_write_accessor mys, mysn, temp;
+};
+
+// Size classes of lqsort: the sequences of up to 2*LQSORT_TINY_WORKGROUP_SIZE elements and of up
+// to 2*LQSORT_SMALL_WORKGROUP_SIZE elements get kernels of their own, with smaller work groups and
+// less local memory than those of up to QUICKSORT_BLOCK_SIZE elements. Both only run the bitonic
+// sort: a tiny work group is about one sub-group, so its barriers are nearly free.
+#ifndef LQSORT_TINY_WORKGROUP_SIZE
+#define LQSORT_TINY_WORKGROUP_SIZE   32
+#endif
+#ifndef LQSORT_SMALL_WORKGROUP_SIZE
+#define LQSORT_SMALL_WORKGROUP_SIZE (LQSORT_LOCAL_WORKGROUP_SIZE/2)
+#endif
+#define LQSORT_BINS 3
+// every class has a smaller work group than the one above it, or it would only split a launch
+static_assert(LQSORT_TINY_WORKGROUP_SIZE < LQSORT_SMALL_WORKGROUP_SIZE && 
+              LQSORT_SMALL_WORKGROUP_SIZE < LQSORT_LOCAL_WORKGROUP_SIZE, 
+              "the lqsort size classes need LQSORT_TINY_WORKGROUP_SIZE < LQSORT_SMALL_WORKGROUP_SIZE < LQSORT_LOCAL_WORKGROUP_SIZE");
+// The lqsort kernels launch only as many work groups as the device keeps resident: about
+// LQSORT_COMPUTE_UNIT_WORK_ITEMS work items of them per compute unit.
+#define LQSORT_COMPUTE_UNIT_WORK_ITEMS (4*LQSORT_LOCAL_WORKGROUP_SIZE)
+
+template <class T>
+using lqsort_small_kernel_class = lqsort_kernel_class<T, LQSORT_SMALL_WORKGROUP_SIZE, 2*LQSORT_SMALL_WORKGROUP_SIZE>;
+template <class T>
+using lqsort_tiny_kernel_class = lqsort_kernel_class<T, LQSORT_TINY_WORKGROUP_SIZE, 2*LQSORT_TINY_WORKGROUP_SIZE>;
+
+// gqsort_kernel writes its partitions a tile of GQSORT_STAGE_ITEMS elements per work item
+// at a time: the tile is compacted into local memory first and the smaller and the larger
+// elements are then stored to the global array as two contiguous runs. A padding slot every
+// LOCAL_MEM_BANKS elements keeps the compacting writes off each other's banks.
+#define GQSORT_STAGE_ITEMS 4
+#define LOCAL_MEM_BANKS    32
+#define STAGE_INDEX(i)     ((i) + (i)/LOCAL_MEM_BANKS)
+#define GQSORT_STAGE_SIZE  STAGE_INDEX(GQSORT_STAGE_ITEMS*GQSORT_LOCAL_WORKGROUP_SIZE)
+// The first pass of gqsort_kernel keeps up to GQSORT_CACHE_SIZE elements of its block in local
+// memory, and the second pass reads them from there, so a block that fits is read from the global
+// array only once. The blocks are cut no larger than that.
+#define GQSORT_CACHE_SIZE  (8*GQSORT_LOCAL_WORKGROUP_SIZE)
+
+// The flags of block_status publish what a work group wrote to the work groups after it: a flag
+// is stored with release and loaded with acquire at device scope, so whoever sees it set sees the
+// counts, or the elements, written before it. A work group fence only orders them for its own group.
+template <memory_order O>
+using block_flag_ref = atomic_ref<uint, O, memory_scope::device, access::address_space::global_space>;
+
+//----------------------------------------------------------------------------
+// Class implements gqsort_kernel
+//----------------------------------------------------------------------------
+template <class T>
+class gqsort_kernel_class {
+	public:
+    static cl::sycl::kernel* kernel;
+
+#ifdef USE_USM
+	using blocks_read_accessor = const block_record<T>*;
+	using parents_read_write_accessor = parent_record*;
+	using news_write_accessor = work_record<T>*;
+	using status_read_write_accessor = block_status*;
+	using tickets_read_write_accessor = uint*;
+	using discard_read_write_accessor = T*;
+#else
+	using blocks_read_accessor = accessor<block_record<T>, 1, access::mode::read, access::target::global_buffer>;
+	using parents_read_write_accessor = accessor<parent_record, 1, access::mode::read_write, access::target::global_buffer>;
+	using news_write_accessor = accessor<work_record<T>, 1, access::mode::write, access::target::global_buffer>;
+	using status_read_write_accessor = accessor<block_status, 1, access::mode::read_write, access::target::global_buffer>;
+	using tickets_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::global_buffer>;
+	using discard_read_write_accessor = 
+	  accessor<T, 1, access::mode::discard_read_write, access::target::global_buffer>;
+#endif
+    using local_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::local>;
+    using local_T_read_write_accessor = accessor<T, 1, access::mode::read_write, access::target::local>;
+
+    // The work groups run blocks[first_block, first_block + number of work groups) of the
+    // num_blocks blocks of the pass, in the order of the tickets they take from tickets[0].
+    gqsort_kernel_class(discard_read_write_accessor db,
+	                    discard_read_write_accessor dnb,
+	                    blocks_read_accessor blocksb,
+	                    parents_read_write_accessor parentsb,
+	                    news_write_accessor newsb, 
+	                    status_read_write_accessor statusb,
+	                    tickets_read_write_accessor ticketsb,
+	                    uint first_blockb,
+	                    uint num_blocksb,
+						local_read_write_accessor lbegb, 
+						local_read_write_accessor gbegb,
+						local_T_read_write_accessor stageb,
+						local_T_read_write_accessor cacheb) :
+						d(db), dn(dnb), blocks(blocksb), 
+						parents(parentsb), news(newsb),
+						status(statusb), tickets(ticketsb), 
+						first_block(first_blockb), num_blocks(num_blocksb),
+						lbeg(lbegb), gbeg(gbegb), stage(stageb), cache(cacheb) {}
+
+    void operator()(nd_item<1> id) {
+        const size_t localid = id.get_local_id(0);
+    	auto g = id.get_group();
+
+	    // Blocks are taken in the order the work groups start, not in the order of their ids:
+	    // the blocks a work group waits for below have then all started.
+	    uint ticket = 0;
+	    if (localid == 0) {
+			auto ticket_a = cl::sycl::atomic<uint>(multi_ptr<uint, access::address_space::global_space>(&tickets[0]));
+	    	ticket = cl::sycl::atomic_fetch_add(ticket_a, (uint)1);
+	    }
+        const size_t blockid = first_block + group_broadcast(g, ticket);
+
+        uint i, lfrom, gfrom, ltp = 0, gtp = 0;
+		T lpivot, gpivot, tmp;
+
+	    // Get the sequence block assigned to this work group
+	    block_record<T> block = blocks[blockid];
+	    uint start = block.start, end = block.end, direction = block.direction;
+		T pivot = block.pivot;
+
+        auto& pparent = parents[block.parent];
+
+	    T *s, *sn;
+
+	    // GPU-Quicksort cannot sort in place, as the regular quicksort algorithm can.
+	    // It therefore needs two arrays to sort things out. We start sorting in the 
+	    // direction of d -> dn and then change direction after each run of gqsort_kernel.
+	    // Which direction we are sorting: d -> dn or dn -> d?
+	    if (direction == 1) {
+	    	s = &d[0];
+	    	sn = &dn[0];
+	    } else {
+	    	s = &dn[0];
+	    	sn = &d[0];
+	    }
+	    // Align thread accesses for coalesced reads.
+	    // Go through data...
+	    for(i = start + localid; i < end; i += GQSORT_LOCAL_WORKGROUP_SIZE) {
+	    	tmp = s[i];
+	    	if (i - start < GQSORT_CACHE_SIZE)
+	    		cache[i - start] = tmp;
+	    	// counting elements that are smaller ...
+	    	if (tmp < pivot)
+	    		ltp++;
+	    	// or larger compared to the pivot.
+	    	if (tmp > pivot) 
+	    		gtp++;
+	    }
+
+    	// calculate cumulative sums with the group scans
+    	const uint ltsum = reduce_over_group(g, ltp, plus<uint>());
+    	const uint gtsum = reduce_over_group(g, gtp, plus<uint>());
+
+	    // Allocate memory in the sequence this block is a part of: decoupled look-back over
+	    // the blocks before it in the parent, which publish their counts as soon as they have
+	    // them and the counts of all the blocks up to them as soon as they know those.
+	    if (localid == 0) {
+	    	auto& mine = status[blockid];
+			block_flag_ref<memory_order::release> flag_a(mine.flag);
+	    	mine.lt = ltsum;
+	    	mine.gt = gtsum;
+	    	flag_a.store((uint)BLOCK_AGGREGATE);
+
+	    	uint ltprefix = 0, gtprefix = 0;
+	    	for(size_t j = blockid; j > 0 && blocks[j - 1].parent == block.parent; j--) {
+	    		auto& before = status[j - 1];
+				block_flag_ref<memory_order::acquire> before_a(before.flag);
+	    		uint flag;
+	    		while ((flag = before_a.load()) == BLOCK_EMPTY)
+	    			;
+	    		if (flag == BLOCK_PREFIX) {
+	    			ltprefix += before.ltprefix;
+	    			gtprefix += before.gtprefix;
+	    			break;
+	    		}
+	    		ltprefix += before.lt;
+	    		gtprefix += before.gt;
+	    	}
+	    	mine.ltprefix = ltprefix + ltsum;
+	    	mine.gtprefix = gtprefix + gtsum;
+	    	flag_a.store((uint)BLOCK_PREFIX);
+
+	    	// the smaller elements go after those of the blocks before, the greater ones before theirs
+	    	lbeg[0] = pparent.oldstart + ltprefix;
+	    	gbeg[0] = pparent.oldend - gtprefix - gtsum;
+	    }
+        id.barrier(access::fence_space::global_and_local);
+
+       	// go thru data again writing elements to their correct position
+#ifdef SUB_GROUP_PARTITION
+		// Allocate locations for work items
+		lfrom = lbeg[0] + exclusive_scan_over_group(g, ltp, plus<uint>());
+		gfrom = gbeg[0] + exclusive_scan_over_group(g, gtp, plus<uint>());
+
+       	auto sg = id.get_sub_group();
+       	sub_group_partition(sg, s, sn, start + (uint)localid - sg.get_local_id()[0], end, GQSORT_LOCAL_WORKGROUP_SIZE,
+       	                    pivot, group_broadcast(sg, lfrom), group_broadcast(sg, gfrom));
+#else
+		lfrom = lbeg[0];
+		gfrom = gbeg[0];
+       	for(uint tile = start; tile < end; tile += GQSORT_STAGE_ITEMS*GQSORT_LOCAL_WORKGROUP_SIZE) {
+       		T v[GQSORT_STAGE_ITEMS];
+       		ltp = gtp = 0;
+       		for(uint k = 0; k < GQSORT_STAGE_ITEMS; k++) {
+       			i = tile + k*GQSORT_LOCAL_WORKGROUP_SIZE + localid;
+       			v[k] = i >= end ? pivot : i - start < GQSORT_CACHE_SIZE ? cache[i - start] : s[i];
+       			ltp += v[k] < pivot;
+       			gtp += v[k] > pivot;
+       		}
+       		// compact the tile in local memory: the smaller elements first, then the larger ones
+       		const uint tilelt = reduce_over_group(g, ltp, plus<uint>());
+       		const uint tilegt = reduce_over_group(g, gtp, plus<uint>());
+       		uint lpos = exclusive_scan_over_group(g, ltp, plus<uint>());
+       		uint gpos = tilelt + exclusive_scan_over_group(g, gtp, plus<uint>());
+       		for(uint k = 0; k < GQSORT_STAGE_ITEMS; k++) {
+       			if (v[k] < pivot) {
+       				stage[STAGE_INDEX(lpos)] = v[k];
+       				lpos++;
+       			}
+       			if (v[k] > pivot) {
+       				stage[STAGE_INDEX(gpos)] = v[k];
+       				gpos++;
+       			}
+       		}
+       		id.barrier(access::fence_space::local_space);
+
+       		// and store both runs with contiguous writes
+       		for(i = localid; i < tilelt; i += GQSORT_LOCAL_WORKGROUP_SIZE)
+       			sn[lfrom + i] = stage[STAGE_INDEX(i)];
+       		for(i = localid; i < tilegt; i += GQSORT_LOCAL_WORKGROUP_SIZE)
+       			sn[gfrom + i] = stage[STAGE_INDEX(tilelt + i)];
+       		lfrom += tilelt;
+       		gfrom += tilegt;
+       		id.barrier(access::fence_space::local_space);
+       	}
+#endif
+        id.barrier(access::fence_space::global_and_local);
+
+    	// the barrier above orders the writes of the whole group before this release
+    	if (localid == 0)
+			block_flag_ref<memory_order::release>(status[blockid].written).store((uint)1);
+
+    	// The last block of the parent finishes it, once all the blocks before it are written
+    	if (blockid + 1 == num_blocks || blocks[blockid + 1].parent != block.parent) {
+    		for(long j = (long)blockid - 1 - (long)localid; j >= 0 && blocks[j].parent == block.parent; j -= GQSORT_LOCAL_WORKGROUP_SIZE) {
+				block_flag_ref<memory_order::acquire> written_a(status[j].written);
+    			while (written_a.load() == 0)
+    				;
+    		}
+    		id.barrier(access::fence_space::global_and_local);
+
+    		uint oldstart = pparent.oldstart;
+    		uint oldend = pparent.oldend;
+    		uint sstart = oldstart + status[blockid].ltprefix;
+    		uint send = oldend - status[blockid].gtprefix;
+
+    		// Store the pivot value between the new sequences, the whole work group at once:
+    		// with many equal keys this range can be most of the parent
+    		for(i = sstart + localid; i < send; i += GQSORT_LOCAL_WORKGROUP_SIZE) {
+#ifdef HALF_MEMORY
+    			// sn is the scratch area, which is copied back to d as a whole
+    			sn[i] = pivot;
+#else
+    			d[i] = pivot;
+#endif
+    		}
+    		id.barrier(access::fence_space::global_and_local);
+
+    		if (localid == 0) {
+    			pparent.sstart = sstart;
+    			pparent.send = send;
+    
+    			lpivot = sn[oldstart];
+    			gpivot = sn[oldend-1];
+    			if (oldstart < sstart) {
+    				lpivot = median_select(lpivot,sn[(oldstart+sstart) >> 1], sn[sstart-1]);
+    			} 
+    			if (send < oldend) {
+    				gpivot = median_select(sn[send],sn[(oldend+send) >> 1], gpivot);
+    			}
+    			
+    			// change the direction of the sort.
+    			direction ^= 1;
+    
+    			news[2*blockid] = work_record<T>{oldstart, sstart, lpivot, direction};
+    			news[2*blockid + 1] = work_record<T>{send, oldend, gpivot, direction};
+    		}
+    	}
+	}
+	private:
+      discard_read_write_accessor d, dn;
+	  blocks_read_accessor blocks;
+	  parents_read_write_accessor parents;
+	  news_write_accessor news;
+	  status_read_write_accessor status;
+	  tickets_read_write_accessor tickets;
+	  uint first_block, num_blocks;
+	  local_read_write_accessor lbeg, gbeg;
+	  local_T_read_write_accessor stage, cache;
+};
+
+#ifdef HALF_MEMORY
+//----------------------------------------------------------------------------
+// Class implements copyback_kernel: moves partitioned pieces from the scratch
+// area back to the array (half-memory mode)
+//----------------------------------------------------------------------------
+template <class T>
+class copyback_kernel_class {
+	public:
+    static cl::sycl::kernel* kernel;
+
+#ifdef USE_USM
+	using read_write_accessor = T*;
+	using read_accessor = const T*;
+	using copies_read_accessor = const copy_record*;
+#else
+	using read_write_accessor = accessor<T, 1, access::mode::read_write, access::target::global_buffer>;
+	using read_accessor = accessor<T, 1, access::mode::read, access::target::global_buffer>;
+	using copies_read_accessor = accessor<copy_record, 1, access::mode::read, access::target::global_buffer>;
+#endif
+
+    copyback_kernel_class(read_write_accessor db, read_accessor scratchb, copies_read_accessor copiesb) :
+						d(db), scratch(scratchb), copies(copiesb) {}
+
+    void operator()(nd_item<1> id) {
+        const size_t blockid = id.get_group(0);
+        const size_t localid = id.get_local_id(0);
+
+		copy_record copy = copies[blockid];
+		for (uint i = copy.start + localid; i < copy.end; i += GQSORT_LOCAL_WORKGROUP_SIZE) {
+			d[i] = scratch[copy.sstart + i - copy.start];
+		}
+	}
+	private:
+	  read_write_accessor d;
+	  read_accessor scratch;
+	  copies_read_accessor copies;
+};
+
+//----------------------------------------------------------------------------
+// Class implements reverse_kernel: reverses segments of the array in place;
+// three reversals make the rotations that merge pieces (half-memory mode)
+//----------------------------------------------------------------------------
+template <class T>
+class reverse_kernel_class {
+	public:
+    static cl::sycl::kernel* kernel;
+
+#ifdef USE_USM
+	using read_write_accessor = T*;
+	using reversals_read_accessor = const reverse_record*;
+#else
+	using read_write_accessor = accessor<T, 1, access::mode::read_write, access::target::global_buffer>;
+	using reversals_read_accessor = accessor<reverse_record, 1, access::mode::read, access::target::global_buffer>;
+#endif
+
+    reverse_kernel_class(read_write_accessor db, reversals_read_accessor reversalsb) :
+						d(db), reversals(reversalsb) {}
+
+    void operator()(nd_item<1> id) {
+        const size_t blockid = id.get_group(0);
+        const size_t localid = id.get_local_id(0);
+
+		reverse_record rev = reversals[blockid];
+		for (uint i = rev.from + localid; i < rev.to; i += GQSORT_LOCAL_WORKGROUP_SIZE) {
+			T tmp = d[rev.start + i];
+			d[rev.start + i] = d[rev.end - 1 - i];
+			d[rev.end - 1 - i] = tmp;
+		}
+	}
+	private:
+	  read_write_accessor d;
+	  reversals_read_accessor reversals;
+};
+#endif // HALF_MEMORY
+
+// lqsort has a kernel for every size class, and all of them are allocated here
+template <class T, uint WG, uint BLOCK>
+cl::sycl::kernel* lqsort_kernel_class<T, WG, BLOCK>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+
+// Note that for every type that we intend to sort we need to allocate this
+template <>
+cl::sycl::kernel* gqsort_kernel_class<uint>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* gqsort_kernel_class<float>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* gqsort_kernel_class<double>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* gqsort_kernel_class<cl_ulong>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+#ifdef HALF_MEMORY
+template <>
+cl::sycl::kernel* copyback_kernel_class<uint>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* reverse_kernel_class<uint>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* copyback_kernel_class<float>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* reverse_kernel_class<float>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* copyback_kernel_class<double>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* reverse_kernel_class<double>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* copyback_kernel_class<cl_ulong>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+template <>
+cl::sycl::kernel* reverse_kernel_class<cl_ulong>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
+#endif // HALF_MEMORY
+
+// USM backend: d and dn live in device allocations and the record vectors in shared
+// allocations that are reused across passes, so no buffers and accessors are created per pass.
+#ifdef USE_USM
+template <class T>
+using device_array = T*;
+template <class R>
+using record_array = const R*;
+template <class R>
+using record_vector = std::vector<R, usm_allocator<R, usm::alloc::shared>>;
+
+template <class R>
+record_vector<R> make_record_vector(OCLResources *pOCL) {
+	return record_vector<R>(usm_allocator<R, usm::alloc::shared>(pOCL->queue));
+}
+
+// the kernels use the record vectors directly; the gqsort passes keep the look-back status of
+// their blocks and their tickets in vectors of the sort
+template <class T>
+struct record_buffers {
+	record_vector<block_status> status;
+	record_vector<uint> tickets;
+	record_buffers(OCLResources *pOCL) : 
+		status(make_record_vector<block_status>(pOCL)), tickets(make_record_vector<uint>(pOCL)) {}
+};
+#else
+template <class T>
+using device_array = buffer<T>&;
+template <class R>
+using record_array = buffer<R>&;
+template <class R>
+using record_vector = std::vector<R>;
+
+template <class R>
+record_vector<R> make_record_vector(OCLResources *pOCL) {
+	return record_vector<R>();
+}
+
+// Device record buffers that the gqsort passes and lqsort of a sort reuse: a buffer is only
+// replaced, by one twice as large as needed, when a pass needs more records than it holds.
+// The records are copied in and out explicitly, instead of through use_host_ptr buffers
+// created and destroyed on every pass.
+template <class R>
+class record_buffer {
+public:
+	record_buffer() : capacity(0) {}
+
+	buffer<R>& reserve(size_t count) {
+		if (!records || count > capacity) {
+			capacity = std::max(std::max(count, 2*capacity), (size_t)1);
+			records.reset(new buffer<R>(range<1>(capacity)));
+		}
+		return *records;
+	}
+
+	void copy_from_host(queue& q, const R* host, size_t count) {
+		buffer<R>& b = reserve(count);
+		if (count == 0)
+			return;
+		q.submit([&](handler& cgh) {
+			auto acc = b.template get_access<access::mode::discard_write>(cgh, range<1>(count));
+			cgh.copy(host, acc);
+		});
+	}
+
+	void copy_to_host(queue& q, R* host, size_t count) {
+		if (count == 0)
+			return;
+		q.submit([&](handler& cgh) {
+			auto acc = records->template get_access<access::mode::read>(cgh, range<1>(count));
+			cgh.copy(acc, host);
+		});
+	}
+
+private:
+	std::unique_ptr<buffer<R>> records;
+	size_t capacity;
+};
+
+template <class T>
+struct record_buffers {
+	record_buffer<block_record<T>> blocks;
+	record_buffer<parent_record> parents;
+	record_buffer<work_record<T>> news, done;
+	record_buffer<block_status> status;
+	record_buffer<uint> tickets;
+	record_buffers(OCLResources *pOCL) {}
+};
+#endif
+
+template <class T>
+void gqsort(OCLResources *pOCL, 
+            device_array<T> d_buffer, 
+			device_array<T> dn_buffer, 
+			record_vector<block_record<T>>& blocks, 
+			record_vector<parent_record>& parents, 
+			record_vector<work_record<T>>& news, 
+			record_buffers<T>& records, 
+			bool reset) {
+#ifdef GET_DETAILED_PERFORMANCE
+	static double absoluteTotal = 0.0;
+	static uint count = 0;
+
+	if (reset) {
+		absoluteTotal = 0.0;
+		count = 0;
+	}
+
+	double beginClock, endClock;
+  beginClock = seconds();
+#endif
+
+	news.resize(blocks.size()*2);
+#ifdef USE_USM
+	records.status.assign(blocks.size(), block_status());
+	records.tickets.assign(1, 0);
+#else
+	// Copy the records into the record buffers of the sort: news is all empty records, as the
+	// kernel only writes the records of the parents it is done with.
+	std::vector<block_status> status(blocks.size());
+	uint ticket = 0;
+	records.blocks.copy_from_host(pOCL->queue, blocks.data(), blocks.size());
+	records.parents.copy_from_host(pOCL->queue, parents.data(), parents.size());
+	records.news.copy_from_host(pOCL->queue, news.data(), news.size());
+	records.status.copy_from_host(pOCL->queue, status.data(), status.size());
+	records.tickets.copy_from_host(pOCL->queue, &ticket, 1);
+	buffer<block_record<T>>&  blocks_buffer = records.blocks.reserve(blocks.size());
+	buffer<parent_record>&  parents_buffer = records.parents.reserve(parents.size());
+	buffer<work_record<T>>&  news_buffer = records.news.reserve(news.size());
+	buffer<block_status>&  status_buffer = records.status.reserve(status.size());
+	buffer<uint>&  tickets_buffer = records.tickets.reserve(1);
+#endif
+
+    pOCL->queue.submit([&](handler& cgh) {
+		using local_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::local>;
+		using local_T_read_write_accessor = accessor<T, 1, access::mode::read_write, access::target::local>;
+#ifdef USE_USM
+	  T* db = d_buffer;
+	  T* dnb = dn_buffer;
+	  const block_record<T>* blocksb = blocks.data();
+	  parent_record* parentsb = parents.data();
+	  work_record<T>* newsb = news.data();
+	  block_status* statusb = records.status.data();
+	  uint* ticketsb = records.tickets.data();
+#else
+	  auto db = d_buffer.template get_access<access::mode::discard_read_write>(cgh);
+	  auto dnb = dn_buffer.template get_access<access::mode::discard_read_write>(cgh);
+	  auto blocksb = blocks_buffer.template get_access<access::mode::read>(cgh);
+	  auto parentsb = parents_buffer.get_access<access::mode::read_write>(cgh);
+	  auto newsb = news_buffer. template get_access<access::mode::write>(cgh);
+	  auto statusb = status_buffer.get_access<access::mode::read_write>(cgh);
+	  auto ticketsb = tickets_buffer.get_access<access::mode::read_write>(cgh);
+#endif
+
+	  local_read_write_accessor
+        lbeg(range<>(1), cgh), gbeg(range<>(1), cgh);
+	  local_T_read_write_accessor stage(range<>(GQSORT_STAGE_SIZE), cgh), cache(range<>(GQSORT_CACHE_SIZE), cgh);
+     
+      auto gqsort = gqsort_kernel_class<T>(db, dnb, blocksb, parentsb, newsb, statusb, ticketsb, 
+                                           0, blocks.size(), lbeg, gbeg, stage, cache);
+
+      cgh.parallel_for(
+        *gqsort.kernel,
+		nd_range<>(GQSORT_LOCAL_WORKGROUP_SIZE * blocks.size(), 
+	               GQSORT_LOCAL_WORKGROUP_SIZE), 
+	    gqsort);
+    });
+#ifndef USE_USM
+	// GPUQSortHalfMemory reads the partition sizes from the parents
+	records.news.copy_to_host(pOCL->queue, news.data(), news.size());
+	records.parents.copy_to_host(pOCL->queue, parents.data(), parents.size());
+#endif
+    pOCL->queue.wait_and_throw();
+
+#ifdef GET_DETAILED_PERFORMANCE
+    endClock = seconds();
+	double totalTime = endClock - beginClock;
+	absoluteTotal += totalTime;
+	std::cout << ++count << ": gqsort time " << absoluteTotal * 1000 << " ms" << std::endl;
+#endif
+}
+
+// Orders done[0, count) from the largest sequence to the smallest and cuts it into the size
+// classes of lqsort: class k takes done[bins[k], bins[k+1]), bins[LQSORT_BINS] == count.
+// The largest sequences take the longest, so their work groups are started first.
+template <class T>
+void bin_lqsort_records(work_record<T>* done, size_t count, size_t* bins) {
+	auto size = [](const work_record<T>& r) { return r.end - r.start; };
+	std::sort(done, done + count, [&](const work_record<T>& a, const work_record<T>& b) {
+		return size(a) > size(b);
+	});
+	auto larger_than = [&](uint limit) {
+		return (size_t)(std::partition_point(done, done + count, [&](const work_record<T>& r) {
+			return size(r) > limit;
+		}) - done);
+	};
+	bins[0] = 0;
+	bins[1] = larger_than(lqsort_small_kernel_class<T>::BLOCK_SIZE);
+	bins[2] = larger_than(lqsort_tiny_kernel_class<T>::BLOCK_SIZE);
+	bins[3] = count;
+}
+
+// Submits lqsort kernel class K on the sequences seqs[first, first + count), which its work
+// groups take by cursors[bin]
+template <class K, class T>
+event submit_lqsort_bin(queue& q, device_array<T> d_buffer, device_array<T> dn_buffer, 
+                        record_array<work_record<T>> seqs_buffer, size_t first, size_t count,
+                        device_array<uint> cursors_buffer, uint bin) {
+	const size_t groups = std::min(count, 
+		std::max((size_t)q.get_device().get_info<info::device::max_compute_units>() * LQSORT_COMPUTE_UNIT_WORK_ITEMS / K::WORKGROUP_SIZE, (size_t)1));
+    return q.submit([&](handler& cgh) {
+		using local_workstack_record_read_write_accessor = accessor<workstack_record, 1, access::mode::read_write, access::target::local>;
+		using local_T_read_write_accessor = accessor<T, 1, access::mode::read_write, access::target::local>;
+		using local_int_read_write_accessor = accessor<int, 1, access::mode::read_write, access::target::local>;
+
+#ifdef USE_USM
+	  T* db = d_buffer;
+	  T* dnb = dn_buffer;
+	  const work_record<T>* seqsb = seqs_buffer;
+	  uint* cursorsb = cursors_buffer;
+#else
+      auto db = d_buffer.template get_access<access::mode::discard_read_write>(cgh);
+	  auto dnb = dn_buffer.template get_access<access::mode::discard_read_write>(cgh);
+      auto seqsb = seqs_buffer.template get_access<access::mode::read>(cgh);
+      auto cursorsb = cursors_buffer.template get_access<access::mode::read_write>(cgh);
+#endif
+
+	  local_workstack_record_read_write_accessor workstack(range<>(std::max(K::BLOCK_SIZE/K::THRESHOLD, 1u)), cgh);
+	  local_int_read_write_accessor workstack_pointer(range<>(1), cgh);
+      local_T_read_write_accessor mys(range<>(K::BLOCK_SIZE), cgh), mysn(range<>(K::BLOCK_SIZE), cgh),
+          temp(range<>(K::THRESHOLD), cgh);
+
+	  auto lqsort = K(db, dnb, seqsb, (uint)first, (uint)count, cursorsb, bin,
+	      workstack, workstack_pointer, mys, mysn, temp);
+
+      cgh.parallel_for(
+		*lqsort.kernel,
+		nd_range<>(K::WORKGROUP_SIZE * groups, 
+	               K::WORKGROUP_SIZE), 
+	    lqsort);
+    });
+}
+
+// Submits lqsort on the size classes that bin_lqsort_records cut, the largest first;
+// cursors holds LQSORT_BINS zeroed counters, one for each size class
+template <class T>
+std::vector<event> submit_lqsort_bins(queue& q, device_array<T> d_buffer, device_array<T> dn_buffer, 
+                                      record_array<work_record<T>> seqs_buffer, const size_t* bins,
+                                      device_array<uint> cursors) {
+	std::vector<event> sorted;
+	if (bins[1] > bins[0])
+		sorted.push_back(submit_lqsort_bin<lqsort_kernel_class<T>, T>(q, d_buffer, dn_buffer, seqs_buffer, bins[0], bins[1] - bins[0], cursors, 0));
+	if (bins[2] > bins[1])
+		sorted.push_back(submit_lqsort_bin<lqsort_small_kernel_class<T>, T>(q, d_buffer, dn_buffer, seqs_buffer, bins[1], bins[2] - bins[1], cursors, 1));
+	if (bins[3] > bins[2])
+		sorted.push_back(submit_lqsort_bin<lqsort_tiny_kernel_class<T>, T>(q, d_buffer, dn_buffer, seqs_buffer, bins[2], bins[3] - bins[2], cursors, 2));
+	return sorted;
+}
+
+template <class T>
+void lqsort(OCLResources *pOCL, 
+            record_vector<work_record<T>>& done, 
+			device_array<T> d_buffer, 
+			device_array<T> dn_buffer, 
+			record_buffers<T>& records) {
+#ifdef GET_DETAILED_PERFORMANCE
+    double beginClock, endClock;
+    beginClock = seconds();
+#endif
+
+	size_t bins[LQSORT_BINS + 1];
+	bin_lqsort_records(done.data(), done.size(), bins);
+	// the gqsort passes are done with the tickets: they count the sequences taken now
+#ifdef USE_USM
+	const work_record<T>* done_buffer = done.data();
+	records.tickets.assign(LQSORT_BINS, 0);
+	uint* cursors = records.tickets.data();
+#else
+	uint zeros[LQSORT_BINS] = {0};
+	records.done.copy_from_host(pOCL->queue, done.data(), done.size());
+	records.tickets.copy_from_host(pOCL->queue, zeros, LQSORT_BINS);
+	buffer<work_record<T>>&  done_buffer = records.done.reserve(done.size());
+	buffer<uint>&  cursors = records.tickets.reserve(LQSORT_BINS);
+#endif
+
+	submit_lqsort_bins<T>(pOCL->queue, d_buffer, dn_buffer, done_buffer, bins, cursors);
+    pOCL->queue.wait_and_throw();
+
+#ifdef GET_DETAILED_PERFORMANCE
+	endClock = seconds();
+	double totalTime = endClock - beginClock;
+	std::cout << "lqsort time " << totalTime * 1000 << " ms" << std::endl;
+#endif
+}
+
+#ifdef HALF_MEMORY
+template <class T>
+void copyback(OCLResources *pOCL, 
+              device_array<T> d_buffer, 
+			  device_array<T> scratch_buffer, 
+			  record_vector<copy_record>& copies) {
+	if (copies.empty())
+		return;
+#ifndef USE_USM
+	buffer<copy_record>  copies_buffer(copies.data(), copies.size(), {property::buffer::use_host_ptr()});
+#endif
+
+    pOCL->queue.submit([&](handler& cgh) {
+#ifdef USE_USM
+	  T* db = d_buffer;
+	  const T* scratchb = scratch_buffer;
+	  const copy_record* copiesb = copies.data();
+#else
+	  auto db = d_buffer.template get_access<access::mode::read_write>(cgh);
+	  auto scratchb = scratch_buffer.template get_access<access::mode::read>(cgh);
+	  auto copiesb = copies_buffer.template get_access<access::mode::read>(cgh);
+#endif
+      auto copyback = copyback_kernel_class<T>(db, scratchb, copiesb);
+
+      cgh.parallel_for(
+        *copyback.kernel,
+		nd_range<>(GQSORT_LOCAL_WORKGROUP_SIZE * copies.size(), 
+	               GQSORT_LOCAL_WORKGROUP_SIZE), 
+	    copyback);
+    });
+    pOCL->queue.wait_and_throw();
+}
+
+template <class T>
+void reverse_segments(OCLResources *pOCL, 
+                      device_array<T> d_buffer, 
+					  record_vector<reverse_record>& reversals) {
+	if (reversals.empty())
+		return;
+#ifndef USE_USM
+	buffer<reverse_record>  reversals_buffer(reversals.data(), reversals.size(), {property::buffer::use_host_ptr()});
+#endif
+
+    pOCL->queue.submit([&](handler& cgh) {
+#ifdef USE_USM
+	  T* db = d_buffer;
+	  const reverse_record* reversalsb = reversals.data();
+#else
+	  auto db = d_buffer.template get_access<access::mode::read_write>(cgh);
+	  auto reversalsb = reversals_buffer.template get_access<access::mode::read>(cgh);
+#endif
+      auto reverse = reverse_kernel_class<T>(db, reversalsb);
+
+      cgh.parallel_for(
+        *reverse.kernel,
+		nd_range<>(GQSORT_LOCAL_WORKGROUP_SIZE * reversals.size(), 
+	               GQSORT_LOCAL_WORKGROUP_SIZE), 
+	    reverse);
+    });
+    pOCL->queue.wait_and_throw();
+}
+#endif // HALF_MEMORY
+
+size_t optp(size_t s, double k, size_t m) {
+	return (size_t)pow(2, floor(log(s*k + m)/log(2.0) + 0.5));
+}
+
+#ifdef HALF_MEMORY
+// Half-memory mode: instead of a second array as large as the input, partition through a scratch
+// area of 1/HALF_MEMORY_SCRATCH_FRACTION of it, so inputs of up to ~90% of device memory fit.
+// Every sequence is cut into pieces no larger than the scratch area. gqsort_kernel partitions a batch
+// of pieces from d into the scratch area, and copyback_kernel moves them back. The pieces of a
+// sequence are then merged pairwise with in-place rotations, each made of three reversals:
+//   [L1 P1 G1][L2 P2 G2] -> [L1 L2 P1 G1 P2 G2] -> [L1 L2 P1 P2 G1 G2]
+// where P are the pivot values gqsort_kernel stored between the partitions.
+#define HALF_MEMORY_SCRATCH_FRACTION 10
+#define HALF_MEMORY_MIN_SCRATCH      (64*QUICKSORT_BLOCK_SIZE)
+// elements (pairs for reversals) moved by one work group
+#define HALF_MEMORY_CHUNK            (16*GQSORT_LOCAL_WORKGROUP_SIZE)
+
+// part of a sequence that is partitioned in one go: [start, end) of d, with lcount elements
+// smaller and gcount elements greater than the pivot of its sequence after gqsort_kernel
+template <class T>
+struct half_memory_piece {
+	uint start, end;
+	uint seq;
+	uint lcount, gcount;
+	T lpivot, gpivot;
+};
+
+void push_reversal(record_vector<reverse_record>& reversals, uint start, uint end) {
+	uint pairs = (end - start)/2;
+	for (uint from = 0; from < pairs; from += HALF_MEMORY_CHUNK)
+		reversals.push_back(reverse_record(start, end, from, std::min(from + HALF_MEMORY_CHUNK, pairs)));
+}
+
+// rotating [start, end) so that mid comes first takes two rounds of reversals:
+// [start, mid) and [mid, end) first, then [start, end)
+void push_rotation(record_vector<reverse_record>& parts, record_vector<reverse_record>& whole, uint start, uint mid, uint end) {
+	if (start == mid || mid == end)
+		return;
+	push_reversal(parts, start, mid);
+	push_reversal(parts, mid, end);
+	push_reversal(whole, start, end);
+}
+
+template <class T>
+void GPUQSortHalfMemory(OCLResources *pOCL, size_t size, T* d) {
+	const size_t SCRATCH_SIZE = std::min(size, std::max(size/HALF_MEMORY_SCRATCH_FRACTION, (size_t)HALF_MEMORY_MIN_SCRATCH));
+#ifdef USE_USM
+	T* d_buffer = malloc_device<T>(size, pOCL->queue);
+	T* scratch_buffer = malloc_device<T>(SCRATCH_SIZE, pOCL->queue);
+	pOCL->queue.memcpy(d_buffer, d, size*sizeof(T)).wait();
+#else
+	buffer<T>  d_buffer(d, size, {property::buffer::use_host_ptr()});
+	buffer<T>  scratch_buffer{range<>(SCRATCH_SIZE)};
+#endif
+
+	const size_t MAXSEQ = optp(size, 0.00009516, 203);
+	const size_t MAX_SIZE = 12*std::max(MAXSEQ, (size_t)QUICKSORT_BLOCK_SIZE);
+	T startpivot = median(d[0], d[size/2], d[size-1]);
+	std::vector<work_record<T>> work;
+	record_vector<work_record<T>> done = make_record_vector<work_record<T>>(pOCL);
+	record_vector<work_record<T>> news = make_record_vector<work_record<T>>(pOCL);
+	work.reserve(MAX_SIZE);
+	done.reserve(MAX_SIZE);
+	news.reserve(MAX_SIZE);
+	record_vector<parent_record> parent_records = make_record_vector<parent_record>(pOCL);
+	parent_records.reserve(MAX_SIZE);
+	record_vector<block_record<T>> blocks = make_record_vector<block_record<T>>(pOCL);
+	blocks.reserve(MAX_SIZE);
+	// device copies of the records, reused by all the passes
+	record_buffers<T> records(pOCL);
+	record_vector<copy_record> copies = make_record_vector<copy_record>(pOCL);
+	record_vector<reverse_record> rot1_parts = make_record_vector<reverse_record>(pOCL);
+	record_vector<reverse_record> rot1_whole = make_record_vector<reverse_record>(pOCL);
+	record_vector<reverse_record> rot2_parts = make_record_vector<reverse_record>(pOCL);
+	record_vector<reverse_record> rot2_whole = make_record_vector<reverse_record>(pOCL);
+	std::vector<half_memory_piece<T>> pieces, merged;
+
+	work.push_back(work_record<T>(0, size, startpivot, 1));
+
+	bool reset = true;
+
+	while(!work.empty()) {
+		// cut the sequences into pieces that fit the scratch area
+		pieces.clear();
+		for(uint seq = 0; seq < work.size(); seq++) {
+			uint start = work[seq].start;
+			uint end   = work[seq].end;
+			uint piececount = (uint)((end - start + SCRATCH_SIZE - 1)/SCRATCH_SIZE);
+			uint piecesize = (end - start + piececount - 1)/piececount;
+			for(uint pstart = start; pstart < end; pstart += piecesize) {
+				half_memory_piece<T> piece = { pstart, std::min(pstart + piecesize, end), seq, 0, 0, T(0), T(0) };
+				pieces.push_back(piece);
+			}
+		}
+
+		size_t blocksize = 0;
+		for(auto it = pieces.begin(); it != pieces.end(); ++it) {
+			blocksize += std::max((it->end - it->start)/MAXSEQ, (size_t)1);
+		}
+		blocksize = std::min(blocksize, (size_t)GQSORT_CACHE_SIZE);
+
+		// partition the pieces, as many at a time as fit the scratch area
+		for(size_t first = 0, last = 0; first < pieces.size(); first = last) {
+			uint sstart = 0;
+			for(last = first; last < pieces.size() && sstart + pieces[last].end - pieces[last].start <= SCRATCH_SIZE; last++) {
+				uint start = pieces[last].start;
+				uint end   = pieces[last].end;
+				T pivot = work[pieces[last].seq].pivot;
+				uint blockcount = (end - start + blocksize - 1)/blocksize;
+				// the parent lives in the scratch area, its blocks in d
+				parent_record prnt(sstart, sstart + end - start, sstart, sstart + end - start, blockcount-1);
+				parent_records.push_back(prnt);
+
+				for(uint i = 0; i < blockcount - 1; i++) {
+					uint bstart = start + blocksize*i;
+					block_record<T> br(bstart, bstart+blocksize, pivot, 1, parent_records.size()-1);
+					blocks.push_back(br);
+				}
+				block_record<T> br(start + blocksize*(blockcount - 1), end, pivot, 1, parent_records.size()-1);
+				blocks.push_back(br);
+
+				for(uint cstart = start; cstart < end; cstart += HALF_MEMORY_CHUNK) {
+					copies.push_back(copy_record(cstart, std::min(cstart + HALF_MEMORY_CHUNK, end), sstart + cstart - start));
+				}
+				sstart += end - start;
+			}
+
+			gqsort(pOCL, d_buffer, scratch_buffer, blocks, parent_records, news, records, reset);
+			reset = false;
+			copyback(pOCL, d_buffer, scratch_buffer, copies);
+
+			for(size_t i = first; i < last; i++) {
+				const parent_record& prnt = parent_records[i - first];
+				pieces[i].lcount = prnt.sstart - prnt.oldstart;
+				pieces[i].gcount = prnt.oldend - prnt.send;
+			}
+			// the last block of every piece stored pivots for its two partitions
+			for(size_t i = 0; i < news.size(); i++) {
+				if (news[i].direction != EMPTY_RECORD) {
+					half_memory_piece<T>& piece = pieces[first + blocks[i/2].parent];
+					if (i % 2 == 0)
+						piece.lpivot = news[i].pivot;
+					else
+						piece.gpivot = news[i].pivot;
+				}
+			}
+			parent_records.clear();
+			blocks.clear();
+			news.clear();
+			copies.clear();
+		}
+
+		// merge neighbouring pieces of the same sequence until one piece per sequence is left
+		for(;;) {
+			merged.clear();
+			for(size_t i = 0; i < pieces.size(); i++) {
+				if (i + 1 == pieces.size() || pieces[i + 1].seq != pieces[i].seq) {
+					merged.push_back(pieces[i]);
+					continue;
+				}
+				const half_memory_piece<T>& a = pieces[i];
+				const half_memory_piece<T>& b = pieces[++i];
+				// [La Pa Ga][Lb Pb Gb] -> [La Lb Pa Ga][Pb Gb] -> [La Lb Pa Pb Ga Gb]
+				uint lend = b.start + b.lcount;
+				push_rotation(rot1_parts, rot1_whole, a.start + a.lcount, b.start, lend);
+				push_rotation(rot2_parts, rot2_whole, lend - a.gcount, lend, b.end - b.gcount);
+				half_memory_piece<T> ab = { a.start, b.end, a.seq, a.lcount + b.lcount, a.gcount + b.gcount,
+				                            a.lcount ? a.lpivot : b.lpivot, a.gcount ? a.gpivot : b.gpivot };
+				merged.push_back(ab);
+			}
+			if (merged.size() == pieces.size())
+				break;
+			reverse_segments(pOCL, d_buffer, rot1_parts);
+			reverse_segments(pOCL, d_buffer, rot1_whole);
+			reverse_segments(pOCL, d_buffer, rot2_parts);
+			reverse_segments(pOCL, d_buffer, rot2_whole);
+			rot1_parts.clear();
+			rot1_whole.clear();
+			rot2_parts.clear();
+			rot2_whole.clear();
+			pieces.swap(merged);
+		}
+
+		work.clear();
+		for(auto it = pieces.begin(); it != pieces.end(); ++it) {
+			work_record<T> children[2] = { work_record<T>(it->start, it->start + it->lcount, it->lpivot, 1),
+			                               work_record<T>(it->end - it->gcount, it->end, it->gpivot, 1) };
+			for(const work_record<T>& child : children) {
+				if (child.end - child.start <= QUICKSORT_BLOCK_SIZE) {
+					if (child.end - child.start > 0)
+						done.push_back(child);
+				} else {
+					work.push_back(child);
+				}
+			}
+		}
+	}
+
+	lqsort(pOCL, done, d_buffer, scratch_buffer, records);
+
+#ifdef USE_USM
+	pOCL->queue.memcpy(d, d_buffer, size*sizeof(T)).wait();
+	cl::sycl::free(d_buffer, pOCL->queue);
+	cl::sycl::free(scratch_buffer, pOCL->queue);
+#endif
+}
+#endif // HALF_MEMORY
+
+#if defined(USE_USM) && !defined(HALF_MEMORY)
+// Overlapped transfers: on discrete devices the upload of d and the download of the result are cut
+// into TRANSFER_CHUNKS chunks and staged through the two halves of a pinned host buffer. The first
+// gqsort pass starts on every chunk as soon as it has arrived, and every chunk of the result is
+// downloaded as soon as the lqsort work groups that sort it are done.
+#define TRANSFER_CHUNKS 8
+
+// Runs blocks[first_block, first_block + count) of the num_blocks blocks of a gqsort pass, which
+// take their tickets from *tickets.
+template <class T>
+event submit_gqsort(OCLResources *pOCL, T* d, T* dn, 
+                    const block_record<T>* blocks, size_t first_block, size_t count, size_t num_blocks, 
+					parent_record* parents, work_record<T>* news, block_status* status, uint* tickets, 
+					const std::vector<event>& dependencies) {
+    return pOCL->queue.submit([&](handler& cgh) {
+		using local_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::local>;
+		using local_T_read_write_accessor = accessor<T, 1, access::mode::read_write, access::target::local>;
+	  cgh.depends_on(dependencies);
+
+	  local_read_write_accessor
+        lbeg(range<>(1), cgh), gbeg(range<>(1), cgh);
+	  local_T_read_write_accessor stage(range<>(GQSORT_STAGE_SIZE), cgh), cache(range<>(GQSORT_CACHE_SIZE), cgh);
+
+      auto gqsort = gqsort_kernel_class<T>(d, dn, blocks, parents, news, status, tickets, 
+                                           first_block, num_blocks, lbeg, gbeg, stage, cache);
+
+      cgh.parallel_for(
+        *gqsort.kernel,
+		nd_range<>(GQSORT_LOCAL_WORKGROUP_SIZE * count, 
+	               GQSORT_LOCAL_WORKGROUP_SIZE), 
+	    gqsort);
+    });
+}
+
+// Submits lqsort on done[0, num_done), which is reordered by size class (see bin_lqsort_records);
+// the event completes when all the size classes are sorted.
+template <class T>
+event submit_lqsort(queue& q, T* d, T* dn, work_record<T>* done, size_t num_done) {
+	size_t bins[LQSORT_BINS + 1];
+	bin_lqsort_records(done, num_done, bins);
+	// lqsort may run next to other passes of the sort: it gets cursors of its own, which the
+	// host task that stands for the kernels of all the size classes frees
+	uint* cursors = malloc_shared<uint>(LQSORT_BINS, q);
+	std::fill(cursors, cursors + LQSORT_BINS, 0);
+	std::vector<event> sorted = submit_lqsort_bins<T>(q, d, dn, done, bins, cursors);
+	context ctx = q.get_context();
+	return q.submit([&](handler& cgh) {
+		cgh.depends_on(sorted);
+		cgh.host_task([cursors, ctx]() { cl::sycl::free(cursors, ctx); });
+	});
+}
+
+// The first gqsort pass, with the upload of d cut into chunks along the boundaries of its blocks.
+// The blocks of the first pass cover d in order, and every block only reads its own part of d.
+// They all belong to one parent and look back at the blocks before them, so the gqsort of a
+// chunk also waits for the gqsort of the chunk before: only the uploads overlap the kernels.
+template <class T>
+void upload_and_gqsort(OCLResources *pOCL, const T* d, T* d_buffer, T* dn_buffer, 
+                       record_vector<block_record<T>>& blocks, 
+					   record_vector<parent_record>& parents, 
+					   record_vector<work_record<T>>& news, 
+					   record_buffers<T>& records) {
+	news.resize(blocks.size()*2);
+	records.status.assign(blocks.size(), block_status());
+	// one ticket counter for each chunk
+	records.tickets.assign(TRANSFER_CHUNKS, 0);
+	const size_t chunk_blocks = (blocks.size() + TRANSFER_CHUNKS - 1)/TRANSFER_CHUNKS;
+	size_t chunk_size = 0;
+	for(size_t b = 0; b < blocks.size(); b += chunk_blocks) {
+		size_t last = std::min(b + chunk_blocks, blocks.size()) - 1;
+		chunk_size = std::max(chunk_size, (size_t)(blocks[last].end - blocks[b].start));
+	}
+	T* staging = malloc_host<T>(2*chunk_size, pOCL->queue);
+
+	std::vector<event> uploads;
+	event sorted;
+	for(size_t b = 0; b < blocks.size(); b += chunk_blocks) {
+		size_t num_blocks = std::min(chunk_blocks, blocks.size() - b);
+		uint start = blocks[b].start;
+		uint end = blocks[b + num_blocks - 1].end;
+		T* stage = staging + (uploads.size() & 1)*chunk_size;
+		// this half of the staging buffer was last used two chunks ago
+		if (uploads.size() >= 2)
+			uploads[uploads.size() - 2].wait();
+		std::copy(d + start, d + end, stage);
+		event upload = pOCL->queue.memcpy(d_buffer + start, stage, (end - start)*sizeof(T));
+		uploads.push_back(upload);
+		std::vector<event> dependencies(1, upload);
+		if (b > 0)
+			dependencies.push_back(sorted);
+		sorted = submit_gqsort(pOCL, d_buffer, dn_buffer, blocks.data(), b, num_blocks, blocks.size(), parents.data(), 
+		                       news.data(), records.status.data(), records.tickets.data() + uploads.size() - 1, dependencies);
+	}
+	pOCL->queue.wait_and_throw();
+	cl::sycl::free(staging, pOCL->queue);
+}
+
+// lqsort with the download of the result cut into chunks. done is ordered by position and cut
+// into batches, and the part of d from the first record of a batch to the first record of the
+// next one is downloaded as soon as the batch is sorted: in between records, gqsort already
+// stored the pivots in their final place.
+template <class T>
+void lqsort_and_download(OCLResources *pOCL, record_vector<work_record<T>>& done, 
+                         T* d_buffer, T* dn_buffer, T* d, size_t size) {
+	std::sort(done.begin(), done.end(), 
+	          [](const work_record<T>& a, const work_record<T>& b) { return a.start < b.start; });
+	// batch k sorts done[first[k]..first[k+1]) and downloads d[starts[k]..starts[k+1])
+	std::vector<size_t> first(1, 0), starts(1, 0);
+	for(size_t r = 1; r < done.size(); r++) {
+		if (done[r].start >= size*starts.size()/TRANSFER_CHUNKS) {
+			first.push_back(r);
+			starts.push_back(done[r].start);
+		}
+	}
+	first.push_back(done.size());
+	starts.push_back(size);
+	const size_t num_batches = first.size() - 1;
+	size_t chunk_size = 0;
+	for(size_t k = 0; k < num_batches; k++)
+		chunk_size = std::max(chunk_size, starts[k+1] - starts[k]);
+	T* staging = malloc_host<T>(2*chunk_size, pOCL->queue);
+
+	std::vector<event> downloads;
+	for(size_t k = 0; k < num_batches; k++) {
+		event sorted;
+		if (first[k+1] > first[k])
+			sorted = submit_lqsort(pOCL->queue, d_buffer, dn_buffer, done.data() + first[k], first[k+1] - first[k]);
+		downloads.push_back(pOCL->queue.memcpy(staging + (k & 1)*chunk_size, d_buffer + starts[k], 
+		                                       (starts[k+1] - starts[k])*sizeof(T), sorted));
+		// meanwhile, move the previous chunk out of the staging buffer
+		if (k > 0) {
+			downloads[k-1].wait();
+			T* stage = staging + ((k-1) & 1)*chunk_size;
+			std::copy(stage, stage + (starts[k] - starts[k-1]), d + starts[k-1]);
+		}
+	}
+	downloads.back().wait();
+	T* stage = staging + ((num_batches-1) & 1)*chunk_size;
+	std::copy(stage, stage + (size - starts[num_batches-1]), d + starts[num_batches-1]);
+	pOCL->queue.wait_and_throw();
+	cl::sycl::free(staging, pOCL->queue);
+}
+
+#ifndef HOST_FINISH
+// Streamed lqsort: as soon as LQSORT_STREAM_RECORDS records are done, lqsort sorts them on a queue
+// of its own while the next gqsort passes run on the main queue. The records cover ranges of d
+// that gqsort does not touch any more, so both kernels can run at the same time, and the last
+// passes, with only a few large sequences left, no longer leave most of the device idle.
+#ifndef LQSORT_STREAM_RECORDS
+#define LQSORT_STREAM_RECORDS 256
+#endif
+
+// Submits lqsort on done[first..done.size()) to lqsort_queue, without waiting for it. done may
+// grow and move before the kernel runs, so the batch gets an allocation of its own.
+template <class T>
+void stream_lqsort(queue& lqsort_queue, T* d_buffer, T* dn_buffer, 
+                   const record_vector<work_record<T>>& done, size_t first, 
+				   std::vector<work_record<T>*>& batches) {
+	work_record<T>* pBatch = malloc_shared<work_record<T>>(done.size() - first, lqsort_queue);
+	std::copy(done.begin() + first, done.end(), pBatch);
+	submit_lqsort(lqsort_queue, d_buffer, dn_buffer, pBatch, done.size() - first);
+	batches.push_back(pBatch);
+}
+#endif // HOST_FINISH
+#endif // USE_USM && !HALF_MEMORY
+
+#if defined(USE_USM) && !defined(HALF_MEMORY) && defined(HOST_FINISH)
+// Host finish: instead of running lqsort on the device once gqsort is over, every record that
+// is small enough for lqsort is downloaded right after the gqsort pass that produced it and
+// sorted on the host by a TBB task, while the device goes on with the next gqsort passes.
+// The pivots stored by a pass between its two new records are final as well and come along.
+template <class T>
+void download_finished(OCLResources *pOCL, const record_vector<work_record<T>>& news, 
+                       T* d_buffer, T* dn_buffer, T* d) {
+	// pieces of d that are final after this pass, in the order gqsort produced them
+	std::vector<uint> starts, ends;
+	std::vector<T*> sources;
+	auto add_piece = [&](uint start, uint end, T* source) {
+		if (start == end)
+			return;
+		// merge with the previous piece when it continues it
+		if (!ends.empty() && ends.back() == start && sources.back() == source) {
+			ends.back() = end;
+		} else {
+			starts.push_back(start);
+			ends.push_back(end);
+			sources.push_back(source);
+		}
+	};
+	for(size_t i = 0; i + 1 < news.size(); i += 2) {
+		const work_record<T>& lo = news[i];
+		const work_record<T>& hi = news[i+1];
+		if (lo.direction == EMPTY_RECORD) 
+			continue;
+		// after a pass the records are in d when their direction is 1 and in dn otherwise
+		if (lo.end - lo.start <= QUICKSORT_BLOCK_SIZE)
+			add_piece(lo.start, lo.end, lo.direction == 1 ? d_buffer : dn_buffer);
+		add_piece(lo.end, hi.start, d_buffer);
+		if (hi.end - hi.start <= QUICKSORT_BLOCK_SIZE)
+			add_piece(hi.start, hi.end, hi.direction == 1 ? d_buffer : dn_buffer);
+	}
+	for(size_t p = 0; p < starts.size(); p++)
+		pOCL->queue.memcpy(d + starts[p], sources[p] + starts[p], (ends[p] - starts[p])*sizeof(T));
+}
+
+// Sorts the records of done on the host, once their download is complete, and clears done.
+template <class T>
+void finish_on_host(tbb::task_group& finishers, T* d, record_vector<work_record<T>>& done) {
+	if (done.empty())
+		return;
+	std::vector<work_record<T>> records(done.begin(), done.end());
+	finishers.run([d, records]() {
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, records.size()), 
+			[&](const tbb::blocked_range<size_t>& r) {
+				for(size_t i = r.begin(); i != r.end(); ++i)
+					std::sort(d + records[i].start, d + records[i].end);
+			});
+	});
+	done.clear();
+}
+#endif // USE_USM && !HALF_MEMORY && HOST_FINISH
+
+// Builds the parent and block records of a gqsort pass from the work records. Every work record
+// is cut into blocks of blocksize elements: a parallel prefix sum over the block counts of the
+// work records gives each of them the place of its blocks, so they are all built in parallel.
+template <class W, class P, class B>
+void make_block_records(const W& work, size_t MAXSEQ, P& parent_records, B& blocks) {
+	typedef typename P::value_type parent_type;
+	typedef typename B::value_type block_type;
+	const size_t blocksize = std::min(tbb::parallel_reduce(tbb::blocked_range<size_t>(0, work.size()), (size_t)0, 
+		[&](const tbb::blocked_range<size_t>& r, size_t sum) {
+			for(size_t i = r.begin(); i != r.end(); ++i)
+				sum += std::max((work[i].end - work[i].start)/MAXSEQ, (size_t)1);
+			return sum;
+		}, std::plus<size_t>()), (size_t)GQSORT_CACHE_SIZE);
+	// first[i] is the index of the first block of work[i]
+	std::vector<size_t> first(work.size() + 1);
+	first[work.size()] = tbb::parallel_scan(tbb::blocked_range<size_t>(0, work.size()), (size_t)0, 
+		[&](const tbb::blocked_range<size_t>& r, size_t sum, bool is_final_scan) {
+			for(size_t i = r.begin(); i != r.end(); ++i) {
+				if (is_final_scan)
+					first[i] = sum;
+				sum += (work[i].end - work[i].start + blocksize - 1)/blocksize;
+			}
+			return sum;
+		}, std::plus<size_t>());
+	parent_records.resize(work.size());
+	blocks.resize(first[work.size()]);
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, work.size()), [&](const tbb::blocked_range<size_t>& r) {
+		for(size_t w = r.begin(); w != r.end(); ++w) {
+			uint start = work[w].start;
+			uint end   = work[w].end;
+			uint direction = work[w].direction;
+			uint blockcount = (uint)(first[w+1] - first[w]);
+			parent_records[w] = parent_type(start, end, start, end, blockcount-1);
+
+			for(uint i = 0; i < blockcount - 1; i++) {
+				uint bstart = start + blocksize*i;
+				blocks[first[w] + i] = block_type(bstart, bstart+blocksize, work[w].pivot, direction, (uint)w);
+			}
+			blocks[first[w] + blockcount - 1] = block_type(start + blocksize*(blockcount - 1), end, work[w].pivot, direction, (uint)w);
+		}
+	});
+}
+
+// Sorts the new records of a gqsort pass into work, the ones still too long for lqsort, and done.
+// A parallel prefix sum over both counts gives every record its place, so the order is kept.
+template <class N, class W, class D>
+void split_new_records(const N& news, W& work, D& done) {
+	typedef std::pair<size_t, size_t> counts; // work records, done records
+	const size_t done_size = done.size();
+	work.resize(news.size());
+	done.resize(done_size + news.size());
+	counts total = tbb::parallel_scan(tbb::blocked_range<size_t>(0, news.size()), counts(0, 0), 
+		[&](const tbb::blocked_range<size_t>& r, counts sum, bool is_final_scan) {
+			for(size_t i = r.begin(); i != r.end(); ++i) {
+				if (news[i].direction == EMPTY_RECORD || news[i].end == news[i].start)
+					continue;
+				if (news[i].end - news[i].start <= QUICKSORT_BLOCK_SIZE /*size/MAXSEQ*/) {
+					if (is_final_scan)
+						done[done_size + sum.second] = news[i];
+					sum.second++;
+				} else {
+					if (is_final_scan)
+						work[sum.first] = news[i];
+					sum.first++;
+				}
+			}
+			return sum;
+		}, [](const counts& a, const counts& b) { return counts(a.first + b.first, a.second + b.second); });
+	work.resize(total.first);
+	done.resize(done_size + total.second);
+}
+
+template <class T>
+void GPUQSort(OCLResources *pOCL, size_t size, T* d, T* dn)  {
+#ifdef HALF_MEMORY
+	// dn is not needed: see GPUQSortHalfMemory
+	GPUQSortHalfMemory(pOCL, size, d);
+#else
+#ifdef USE_USM
+	// allocate device memory; dn is only scratch, so it needs no copy
+	T* d_buffer = malloc_device<T>(size, pOCL->queue);
+	T* dn_buffer = malloc_device<T>(size, pOCL->queue);
+	// on discrete devices the transfers overlap the sort: see upload_and_gqsort and lqsort_and_download
+	const bool overlap_transfers = !pOCL->queue.get_device().get_info<info::device::host_unified_memory>() &&
+	                               size >= TRANSFER_CHUNKS*QUICKSORT_BLOCK_SIZE;
+	if (!overlap_transfers)
+		pOCL->queue.memcpy(d_buffer, d, size*sizeof(T)).wait();
+#else
+	// allocate buffers
+	buffer<T>  d_buffer(d, size, {property::buffer::use_host_ptr()});
+	buffer<T>  dn_buffer(dn, size, {property::buffer::use_host_ptr()});
+#endif
+
+	const size_t MAXSEQ = optp(size, 0.00009516, 203);
+	const size_t MAX_SIZE = 12*std::max(MAXSEQ, (size_t)QUICKSORT_BLOCK_SIZE);
+	//std::cout << "MAXSEQ = " << MAXSEQ << std::endl;
+	T startpivot = median(d[0], d[size/2], d[size-1]);
+	std::vector<work_record<T>> work;
+	record_vector<work_record<T>> done = make_record_vector<work_record<T>>(pOCL);
+	record_vector<work_record<T>> news = make_record_vector<work_record<T>>(pOCL);
+	work.reserve(MAX_SIZE);
+	done.reserve(MAX_SIZE);
+	news.reserve(MAX_SIZE);
+	record_vector<parent_record> parent_records = make_record_vector<parent_record>(pOCL);
+	parent_records.reserve(MAX_SIZE);
+	record_vector<block_record<T>> blocks = make_record_vector<block_record<T>>(pOCL);
+	blocks.reserve(MAX_SIZE);
+	// device copies of the records, reused by all the passes
+	record_buffers<T> records(pOCL);
+	
+	work.push_back(work_record<T>(0, size, startpivot, 1));
+
+	bool reset = true;
+#if defined(USE_USM) && defined(HOST_FINISH)
+	tbb::task_group finishers;
+#elif defined(USE_USM)
+	// see stream_lqsort
+	queue lqsort_queue(pOCL->queue.get_context(), pOCL->queue.get_device());
+	std::vector<work_record<T>*> batches;
+	size_t streamed = 0; // done records already given to stream_lqsort
+#endif
+
+	while(!work.empty() /*&& work.size() + done.size() < MAXSEQ*/) {
+		make_block_records(work, MAXSEQ, parent_records, blocks);
+
+#ifdef USE_USM
+		if (reset && overlap_transfers)
+			upload_and_gqsort(pOCL, d, d_buffer, dn_buffer, blocks, parent_records, news, records);
+		else
+#endif
+		gqsort(pOCL, d_buffer, dn_buffer, blocks, parent_records, news, records, reset);
+		reset = false;
+#if defined(USE_USM) && defined(HOST_FINISH)
+		// gqsort waits for the queue, so the downloads of the previous pass are complete
+		finish_on_host(finishers, d, done);
+		download_finished(pOCL, news, d_buffer, dn_buffer, d);
+#endif
+		//std::cout << " blocks = " << blocks.size() << " parent records = " << parent_records.size() << " news = " << news.size() << std::endl;
+		parent_records.clear();
+		blocks.clear();
+		split_new_records(news, work, done);
+		news.clear();
+#if defined(USE_USM) && !defined(HOST_FINISH)
+		if (!work.empty() && done.size() - streamed >= LQSORT_STREAM_RECORDS) {
+			stream_lqsort(lqsort_queue, d_buffer, dn_buffer, done, streamed, batches);
+			streamed = done.size();
+		}
+#endif
+	}
+	for(auto it = work.begin(); it != work.end(); ++it) {
+		if (it->end - it->start > 0)
+			done.push_back(*it);
+	}
+
+#ifdef USE_USM
+#ifdef HOST_FINISH
+	pOCL->queue.wait_and_throw();
+	finish_on_host(finishers, d, done);
+	finishers.wait();
+#else
+	// the streamed records are sorted before any of d is downloaded
+	lqsort_queue.wait_and_throw();
+	for(auto pBatch : batches)
+		cl::sycl::free(pBatch, lqsort_queue);
+	done.erase(done.begin(), done.begin() + streamed);
+	if (overlap_transfers) {
+		lqsort_and_download(pOCL, done, d_buffer, dn_buffer, d, size);
+	} else {
+		if (!done.empty())
+			lqsort(pOCL, done, d_buffer, dn_buffer, records);
+		pOCL->queue.memcpy(d, d_buffer, size*sizeof(T)).wait();
+	}
+#endif // HOST_FINISH
+	cl::sycl::free(d_buffer, pOCL->queue);
+	cl::sycl::free(dn_buffer, pOCL->queue);
+#else
+	lqsort(pOCL, done, d_buffer, dn_buffer, records);
+#endif
+#endif // HALF_MEMORY
+}
+
+#if defined(USE_USM) && !defined(HALF_MEMORY)
+// Asynchronous sort of device memory: d and dn are device allocations of size elements, which the
+// sort starts on once the dependencies are complete. The gqsort passes are driven by a host thread,
+// which waits for its own passes only, and the future returns the event of the final lqsort as
+// soon as it is submitted: the caller can make its own kernels or copies depend on it, without
+// waiting for the sort on the host. dn must stay allocated until that event is complete.
+template <class T>
+std::future<event> GPUQSortAsync(OCLResources *pOCL, size_t size, T* d, T* dn, 
+                                 const std::vector<event>& dependencies = std::vector<event>()) {
+	return std::async(std::launch::async, [pOCL, size, d, dn, dependencies]() {
+		if (size < 2) {
+			return pOCL->queue.submit([&](handler& cgh) {
+				cgh.depends_on(dependencies);
+				cgh.host_task([]() {});
+			});
+		}
+
+		// the start pivot needs the first, middle and last elements on the host
+		T samples[3];
+		event copies[3] = { pOCL->queue.memcpy(&samples[0], d, sizeof(T), dependencies), 
+		                    pOCL->queue.memcpy(&samples[1], d + size/2, sizeof(T), dependencies), 
+		                    pOCL->queue.memcpy(&samples[2], d + size - 1, sizeof(T), dependencies) };
+		for(event& copy : copies)
+			copy.wait();
+
+		const size_t MAXSEQ = optp(size, 0.00009516, 203);
+		const size_t MAX_SIZE = 12*std::max(MAXSEQ, (size_t)QUICKSORT_BLOCK_SIZE);
+		T startpivot = median(samples[0], samples[1], samples[2]);
+		std::vector<work_record<T>> work;
+		record_vector<work_record<T>> done = make_record_vector<work_record<T>>(pOCL);
+		record_vector<work_record<T>> news = make_record_vector<work_record<T>>(pOCL);
+		work.reserve(MAX_SIZE);
+		done.reserve(MAX_SIZE);
+		news.reserve(MAX_SIZE);
+		record_vector<parent_record> parent_records = make_record_vector<parent_record>(pOCL);
+		parent_records.reserve(MAX_SIZE);
+		record_vector<block_record<T>> blocks = make_record_vector<block_record<T>>(pOCL);
+		blocks.reserve(MAX_SIZE);
+
+		record_buffers<T> records(pOCL);
+
+		work.push_back(work_record<T>(0, size, startpivot, 1));
+
+		while(!work.empty()) {
+			make_block_records(work, MAXSEQ, parent_records, blocks);
+			news.resize(blocks.size()*2);
+			records.status.assign(blocks.size(), block_status());
+			records.tickets.assign(1, 0);
+			submit_gqsort(pOCL, d, dn, blocks.data(), 0, blocks.size(), blocks.size(), parent_records.data(), news.data(), 
+			              records.status.data(), records.tickets.data(), std::vector<event>()).wait_and_throw();
+			parent_records.clear();
+			blocks.clear();
+			split_new_records(news, work, done);
+			news.clear();
+		}
+
+		// lqsort reads done after this thread is gone: it gets an allocation of its own, which a
+		// host task frees once lqsort is complete
+		work_record<T>* pDone = malloc_shared<work_record<T>>(std::max(done.size(), (size_t)1), pOCL->queue);
+		std::copy(done.begin(), done.end(), pDone);
+		event sorted = submit_lqsort(pOCL->queue, d, dn, pDone, done.size());
+		context ctx = pOCL->queue.get_context();
+		pOCL->queue.submit([&](handler& cgh) {
+			cgh.depends_on(sorted);
+			cgh.host_task([pDone, ctx]() { cl::sycl::free(pDone, ctx); });
+		});
+		return sorted;
+	});
+}
+#endif // USE_USM && !HALF_MEMORY
+
+// Sorter pool: sort requests from several threads go to separate in-order queues on the same
+// device and context. GPUQSort waits on its own queue only, so independent sorts interleave their
+// gqsort and lqsort passes on the device instead of queuing up behind each other.
+class SorterPool
+{
+public:
+	SorterPool(OCLResources* pOCL, size_t num_queues) : resources(num_queues, *pOCL) {
+		for(auto& r : resources) {
+			r.queue = queue(pOCL->queue.get_context(), pOCL->queue.get_device(), property::queue::in_order());
+			r.cmdQHdl = r.queue.get();
+			idle.push_back(&r);
+		}
+	}
+
+	// Blocks until a queue is free, then sorts on the calling thread
+	template <class T>
+	void Sort(size_t size, T* d, T* dn) {
+		OCLResources* pOCL = Acquire();
+		try {
+			GPUQSort(pOCL, size, d, dn);
+		} catch (...) {
+			Release(pOCL);
+			throw;
+		}
+		Release(pOCL);
+	}
+
+	size_t size() const { return resources.size(); }
+
+private:
+	OCLResources* Acquire() {
+		std::unique_lock<std::mutex> lock(idle_mutex);
+		idle_cv.wait(lock, [this]() { return !idle.empty(); });
+		OCLResources* pOCL = idle.back();
+		idle.pop_back();
+		return pOCL;
+	}
+
+	void Release(OCLResources* pOCL) {
+		{
+			std::lock_guard<std::mutex> lock(idle_mutex);
+			idle.push_back(pOCL);
+		}
+		idle_cv.notify_one();
+	}
+
+	std::vector<OCLResources> resources;
+	std::vector<OCLResources*> idle;
+	std::mutex idle_mutex;
+	std::condition_variable idle_cv;
+};
+
+// Heterogeneous sort: the device and the host cores sort at the same time. A splitter sampled
+// from d splits it into a lower share for GPUQSort and an upper share for tbb::parallel_sort,
+// and the sorted shares concatenate to the result. The shares follow the throughput each side
+// reached in the previous call, so that both finish at about the same time.
+#define HETERO_SAMPLES 4096
+// neither side gets less than this fraction, so that both keep being measured
+#define HETERO_MIN_SHARE 0.0625
+
+typedef struct
+{
+	double gpu_rate;	// elements per second
+	double cpu_rate;
+	double gpu_share;	// of the last call
+} hetero_sort_state;
+
+void InitHeteroSortState(hetero_sort_state* pState)
+{
+	pState->gpu_rate = pState->cpu_rate = 1.0;
+	pState->gpu_share = 0.5;
+}
+
+// Moves the elements of in that are smaller than splitter to the front of out and the others to the back;
+// returns the number of smaller elements
+template <class T>
+size_t ParallelPartition(const T* in, T* out, size_t size, T splitter)
+{
+	const size_t grain = 1 << 16;
+	const size_t num_chunks = (size + grain - 1)/grain;
+	std::vector<size_t> lows(num_chunks + 1, 0);
+	tbb::parallel_for(size_t(0), num_chunks, [&](size_t c) {
+		const T* end = in + std::min(size, (c + 1)*grain);
+		lows[c + 1] = std::count_if(in + c*grain, end, [splitter](T x) { return x < splitter; });
+	});
+	// lows[c]: smaller elements before chunk c
+	for(size_t c = 0; c < num_chunks; c++)
+		lows[c + 1] += lows[c];
+	const size_t num_low = lows[num_chunks];
+	tbb::parallel_for(size_t(0), num_chunks, [&](size_t c) {
+		size_t l = lows[c], g = num_low + c*grain - lows[c];
+		const size_t end = std::min(size, (c + 1)*grain);
+		for(size_t i = c*grain; i < end; i++) {
+			if (in[i] < splitter)
+				out[l++] = in[i];
+			else
+				out[g++] = in[i];
+		}
+	});
+	return num_low;
+}
+
+template <class T>
+void HeteroSort(OCLResources *pOCL, size_t size, T* d, T* dn, hetero_sort_state* pState)
+{
+	if (size < HETERO_SAMPLES) {
+		tbb::parallel_sort(d, d + size);
+		return;
+	}
+	double share = pState->gpu_rate/(pState->gpu_rate + pState->cpu_rate);
+	share = std::min(std::max(share, HETERO_MIN_SHARE), 1.0 - HETERO_MIN_SHARE);
+
+	std::vector<T> samples(HETERO_SAMPLES);
+	for(size_t i = 0; i < HETERO_SAMPLES; i++)
+		samples[i] = d[(size_t)((i + 0.5)*size/HETERO_SAMPLES)];
+	std::sort(samples.begin(), samples.end());
+	T splitter = samples[(size_t)(share*HETERO_SAMPLES)];
+
+	// device: dn[0, num_low), with d as its scratch; host: dn[num_low, size)
+	const size_t num_low = ParallelPartition(d, dn, size, splitter);
+	std::future<double> gpu = std::async(std::launch::async, [=]() {
+		double beginClock = seconds();
+		if (num_low > 1)
+			GPUQSort(pOCL, num_low, dn, d);
+		return seconds() - beginClock;
+	});
+	double beginClock = seconds();
+	tbb::parallel_sort(dn + num_low, dn + size);
+	double cpu_time = seconds() - beginClock;
+	double gpu_time = gpu.get();
+
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, size), [=](const tbb::blocked_range<size_t>& r) {
+		std::copy(dn + r.begin(), dn + r.end(), d + r.begin());
+	});
+
+	if (num_low > 0 && gpu_time > 0.0)
+		pState->gpu_rate = num_low/gpu_time;
+	if (num_low < size && cpu_time > 0.0)
+		pState->cpu_rate = (size - num_low)/cpu_time;
+	pState->gpu_share = (double)num_low/size;
+}
+
+// Kernels of different types are built concurrently (see BuildKernels), so their messages are
+// printed one whole line at a time.
+static std::mutex print_mutex;
+
+void PrintLine(const std::string& line)
+{
+	std::lock_guard<std::mutex> lock(print_mutex);
+	std::cout << line << std::endl;
+}
+
+// Writes num random keys of type T to a raw binary file, for the tools that sort files to have
+// something to sort. The keys depend on num only, so a size always gives the same file.
+template <class T>
+int GenerateKeyFile(unsigned long long num, const std::string& fileName)
+{
+	FILE* fp = fopen(fileName.c_str(), "wb");
+	if (fp == NULL) {
+		std::cerr << "Failed to create " << fileName << std::endl;
+		return -1;
+	}
+	std::mt19937_64 gen(num);
+	std::vector<T> buf(1 << 20);
+	for(unsigned long long i = 0; i < num; i += buf.size()) {
+		size_t n = (size_t)std::min((unsigned long long)buf.size(), num - i);
+		for(size_t j = 0; j < n; j++)
+			buf[j] = (T)(gen() >> (64 - 8*std::min(sizeof(T), (size_t)8)));
+		if (fwrite(buf.data(), sizeof(T), n, fp) != n) {
+			std::cerr << "Failed to write " << fileName << std::endl;
+			fclose(fp);
+			return -1;
+		}
+	}
+	if (fclose(fp) != 0) {
+		std::cerr << "Failed to write " << fileName << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef USE_PROGRAM_BINARY_CACHE
+#define KERNEL_KEY_STRING(x) #x
+#define KERNEL_KEY_VALUE(x)  KERNEL_KEY_STRING(x)
+// Key of the cached kernel binaries besides the kernel name: the hash of the kernel sources
+// and the build macros that change the kernels
+static const char* kernel_cache_key = KERNEL_SOURCE_HASH
+	" QUICKSORT_BLOCK_SIZE=" KERNEL_KEY_VALUE(QUICKSORT_BLOCK_SIZE)
+	" GQSORT_LOCAL_WORKGROUP_SIZE=" KERNEL_KEY_VALUE(GQSORT_LOCAL_WORKGROUP_SIZE)
+	" LQSORT_LOCAL_WORKGROUP_SIZE=" KERNEL_KEY_VALUE(LQSORT_LOCAL_WORKGROUP_SIZE)
+#ifdef USE_USM
+	" USE_USM"
+#endif
+#ifdef HALF_MEMORY
+	" HALF_MEMORY"
+#endif
+#ifdef SUB_GROUP_PARTITION
+	" SUB_GROUP_PARTITION"
+#endif
+	;
+#endif
+
+// Acquires the kernel of kernel class K and stores it in K::kernel:
+// first tries a binary cached by an earlier run, otherwise builds the kernel and caches its binary.
+template <class K>
+bool AcquireKernel(OCLResources& myOCL, const char* pKernelName, const std::string& type_name)
+{
+	double beginClock, endClock;
+	std::string kernel_name = std::string(pKernelName) + "<" + type_name + ">";
+	try {
+#ifdef USE_PROGRAM_BINARY_CACHE
+		std::string cacheFile = KernelCacheFileName(myOCL.deviceID, kernel_name.c_str(), kernel_cache_key);
+		cl_program oclProgramHdl;
+		beginClock = seconds();
+		if (LoadCachedProgram(cacheFile, myOCL.deviceID, myOCL.contextHdl, &oclProgramHdl)) {
+			cl::sycl::program program(myOCL.queue.get_context(), oclProgramHdl);
+			clReleaseProgram(oclProgramHdl);
+			new (K::kernel) cl::sycl::kernel(program.get_kernel<K>());
+			endClock = seconds();
+			PrintLine("Loaded " + kernel_name + " from " + cacheFile + ": " + std::to_string((endClock - beginClock) * 1000) + " ms");
+			return true;
+		}
+#endif
+		cl::sycl::program program(myOCL.queue.get_context());
+		PrintLine("before program.build_with_kernel_type<" + kernel_name + ">();");
+		beginClock = seconds();
+		program.build_with_kernel_type<K>();
+		endClock = seconds();
+		//BuildFailLog(program.get(), myOCL.deviceID);
+		PrintLine("after program.build_with_kernel_type<" + kernel_name + ">();");
+		PrintLine("Time to build SYCL Program " + kernel_name + ": " + std::to_string((endClock - beginClock) * 1000) + " ms");
+#ifdef USE_PROGRAM_BINARY_CACHE
+		SaveProgramBinary(cacheFile, program.get());
+#endif
+		new (K::kernel) cl::sycl::kernel(program.get_kernel<K>());
+		PrintLine("Successfully acquired " + kernel_name + "!");
+	} catch (const cl::sycl::exception& e) {
+		PrintLine(std::string("SYCL exception caught: ") + e.what());
+		return false;
+	} catch (const std::exception& e) {
+		PrintLine(std::string("C++ exception caught: ") + e.what());
+		return false;
+	}
+	return true;
+}
+
+// Acquires the lqsort kernels of all the size classes for type T
+template <class T>
+bool AcquireLqsortKernels(OCLResources* pOCL, const std::string& type_name)
+{
+	auto size_class = [&](uint wg, uint block) {
+		return type_name + ", " + std::to_string(wg) + ", " + std::to_string(block);
+	};
+	return AcquireKernel<lqsort_kernel_class<T>>(*pOCL, "lqsort_kernel_class", 
+	           size_class(LQSORT_LOCAL_WORKGROUP_SIZE, QUICKSORT_BLOCK_SIZE)) &&
+	       AcquireKernel<lqsort_small_kernel_class<T>>(*pOCL, "lqsort_kernel_class", 
+	           size_class(LQSORT_SMALL_WORKGROUP_SIZE, 2*LQSORT_SMALL_WORKGROUP_SIZE)) &&
+	       AcquireKernel<lqsort_tiny_kernel_class<T>>(*pOCL, "lqsort_kernel_class", 
+	           size_class(LQSORT_TINY_WORKGROUP_SIZE, 2*LQSORT_TINY_WORKGROUP_SIZE));
+}
+
+// Builds all the kernels for type T; main() runs one of these per type on a worker thread
+template <class T>
+bool BuildKernels(OCLResources* pOCL, std::string type_name)
+{
+//#define SWAP_ORDER 1
+#ifdef HALF_MEMORY
+	if (!AcquireKernel<copyback_kernel_class<T>>(*pOCL, "copyback_kernel_class", type_name) ||
+	    !AcquireKernel<reverse_kernel_class<T>>(*pOCL, "reverse_kernel_class", type_name))
+		return false;
+#endif
+#ifdef SWAP_ORDER
+	return AcquireKernel<gqsort_kernel_class<T>>(*pOCL, "gqsort_kernel_class", type_name) &&
+	       AcquireLqsortKernels<T>(pOCL, type_name);
+#else
+	return AcquireLqsortKernels<T>(pOCL, type_name) &&
+	       AcquireKernel<gqsort_kernel_class<T>>(*pOCL, "gqsort_kernel_class", type_name);
+#endif
+}
+
+#endif // GPUQSORT_DOT_H
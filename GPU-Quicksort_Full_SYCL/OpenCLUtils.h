@@ -34,7 +34,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <assert.h>
 #include <string>
+#include <string.h>
 #include <CL/cl.h>
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 // Util for error checking:
 //#undef __OCL_NO_ERROR_CHECKING
@@ -88,6 +94,150 @@ void BuildFailLog(cl_program program,
 	}
 }
 
+// Util for caching built SYCL kernels on disk:
+// Building a kernel class from SPIR-V on first use dominates the run time of short-lived processes.
+// Once a kernel is built, its device binary is stored under a key made of the kernel name with its
+// template parameters, the kernel sources and build macros, the device and the driver version;
+// later runs reload it with clCreateProgramWithBinary. Kernels compiled ahead of time (see SYCL_AOT_* in CMakeLists.txt)
+// are already native, so for them the cache only skips the remaining finalization.
+// Set QUICKSORT_CL_CACHE_DIR to choose the cache directory (the current directory by default),
+// or comment out the define below to always build at run time.
+#define USE_PROGRAM_BINARY_CACHE 1
+// The kernel sources enter the key as KERNEL_SOURCE_HASH, which CMakeLists.txt computes from the
+// headers; a build that does not define it gets no cache rather than one it cannot keep current.
+#if defined(USE_PROGRAM_BINARY_CACHE) && !defined(KERNEL_SOURCE_HASH)
+#undef USE_PROGRAM_BINARY_CACHE
+#endif
+
+// 64-bit FNV-1a hash of a string
+unsigned long long HashString(const char* pStr, unsigned long long hash)
+{
+	for (; *pStr; pStr++) {
+		hash ^= (unsigned char)*pStr;
+		hash *= 1099511628211ULL;
+	}
+	// terminate every field so that "ab" + "c" and "a" + "bc" hash differently
+	hash ^= 0xff;
+	hash *= 1099511628211ULL;
+	return hash;
+}
+
+std::string KernelCacheFileName(cl_device_id oclDeviceID, const char* pKernelName, const char* pKernelKey)
+{
+	char pDeviceNameString[512];
+	char pDriverVersionString[512];
+	cl_int ciErrNum = clGetDeviceInfo(oclDeviceID, CL_DEVICE_NAME, sizeof(pDeviceNameString), pDeviceNameString, NULL);
+	if (ciErrNum != CL_SUCCESS)
+		pDeviceNameString[0] = '\0';
+	ciErrNum = clGetDeviceInfo(oclDeviceID, CL_DRIVER_VERSION, sizeof(pDriverVersionString), pDriverVersionString, NULL);
+	if (ciErrNum != CL_SUCCESS)
+		pDriverVersionString[0] = '\0';
+
+	// pKernelKey stands for the kernel sources and the build macros the kernel is compiled with
+	unsigned long long hash = 14695981039346656037ULL;
+	hash = HashString(pKernelName, hash);
+	hash = HashString(pKernelKey, hash);
+	hash = HashString(pDeviceNameString, hash);
+	hash = HashString(pDriverVersionString, hash);
+
+	const char* pCacheDir = getenv("QUICKSORT_CL_CACHE_DIR");
+	if (!pCacheDir || !*pCacheDir)
+		pCacheDir = ".";
+
+	char pFileName[64];
+	sprintf(pFileName, "/QuicksortSYCL-%016llx.clbin", hash);
+	return std::string(pCacheDir) + pFileName;
+}
+
+bool LoadCachedProgram(const std::string& cacheFile, cl_device_id oclDeviceID, cl_context oclContextHdl, cl_program* pOclProgramHdl)
+{
+	FILE* fp = fopen(cacheFile.c_str(), "rb");
+	if (!fp)
+		return false;
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (size <= 0) {
+		fclose(fp);
+		return false;
+	}
+
+	unsigned char* buf = (unsigned char*)malloc(size);
+	if (buf == 0) {
+		fclose(fp);
+		return false;
+	}
+	size_t records_read = fread(buf, size, 1, fp);
+	fclose(fp);
+	if (records_read != 1) {
+		free(buf);
+		return false;
+	}
+
+	size_t szBinaryLength = size;
+	cl_int binaryStatus;
+	cl_int ciErrNum;
+	cl_program oclProgramHdl = clCreateProgramWithBinary(oclContextHdl, 1, &oclDeviceID, &szBinaryLength, (const unsigned char **) &buf, &binaryStatus, &ciErrNum);
+	free(buf);
+	if (ciErrNum != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+		if (oclProgramHdl)
+			clReleaseProgram(oclProgramHdl);
+		return false;
+	}
+
+	// Binaries still have to be built, but this does not involve the SPIR-V translation
+	ciErrNum = clBuildProgram(oclProgramHdl, 1, &oclDeviceID, NULL, NULL, NULL);
+	if (ciErrNum != CL_SUCCESS) {
+		clReleaseProgram(oclProgramHdl);
+		return false;
+	}
+
+	*pOclProgramHdl = oclProgramHdl;
+	return true;
+}
+
+void SaveProgramBinary(const std::string& cacheFile, cl_program oclProgramHdl)
+{
+	// The program is built for exactly one device
+	size_t szBinaryLength = 0;
+	cl_int ciErrNum = clGetProgramInfo(oclProgramHdl, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &szBinaryLength, NULL);
+	if (ciErrNum != CL_SUCCESS || szBinaryLength == 0)
+		return;
+
+	unsigned char* buf = (unsigned char*)malloc(szBinaryLength);
+	if (buf == 0)
+		return;
+	ciErrNum = clGetProgramInfo(oclProgramHdl, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &buf, NULL);
+	if (ciErrNum != CL_SUCCESS) {
+		free(buf);
+		return;
+	}
+
+	// Write to a temporary file first: concurrent workers must never see a partially written binary
+	char pSuffix[32];
+#ifdef _MSC_VER
+	sprintf(pSuffix, ".%u.tmp", (unsigned)GetCurrentProcessId());
+#else
+	sprintf(pSuffix, ".%u.tmp", (unsigned)getpid());
+#endif
+	std::string tmpFile = cacheFile + pSuffix;
+	FILE* fp = fopen(tmpFile.c_str(), "wb");
+	if (!fp) {
+		printf("Failed to write the SYCL kernel binary cache: %s\n", tmpFile.c_str());
+		free(buf);
+		return;
+	}
+	size_t records_written = fwrite(buf, szBinaryLength, 1, fp);
+	int err = fclose(fp);
+	free(buf);
+	if (records_written != 1 || err != 0 || rename(tmpFile.c_str(), cacheFile.c_str()) != 0)
+		remove(tmpFile.c_str());
+}
+
 static bool isNvidiaGpu = false;
 
+// Util for sorting files in place through a memory mapping:
+#include "../GPU-Quicksort_Common/MappedFile.h"
+
 #endif
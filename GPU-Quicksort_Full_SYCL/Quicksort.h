@@ -77,6 +77,16 @@ template <> struct select_type_selector<double>
 #endif
 };
 
+// 64-bit keys, e.g. fingerprints
+template <> struct select_type_selector<cl_ulong>
+{
+#ifdef _MSC_VER
+  typedef ulonglong data_t;
+#else
+  typedef ulong data_t;
+#endif
+};
+
 template <class T>
 T median_select(T x1, T x2, T x3) {
 	if (x1 < x2) {
@@ -159,8 +169,8 @@ struct work_record {
 // parent record contains everything kernels need to know about the parent of a set of blocks:
 // initially, the first two fields equal to the third and fourth fields respectively
 // blockcount contains the total number of blocks associated with the parent.
-// During processing, sstart and send get incremented. At the end of gqsort_kernel, all the 
-// parent record fields are used to calculate new pivots and new work records.
+// The last block of the parent in gqsort_kernel sets sstart and send to the ends of the two
+// partitions, and all the parent record fields are used to calculate new pivots and new work records.
 typedef struct parent_record {
 	uint sstart, send, oldstart, oldend, blockcount; 
     parent_record() :
@@ -182,4 +192,36 @@ struct block_record {
 	block_record(uint s, uint e, T p, uint d, uint prnt) : 
 		start(s), end(e), pivot(p), direction(d), parent(prnt) {}
 };
+
+// block status is what a block of gqsort_kernel publishes for the blocks after it in the same
+// parent (decoupled look-back): flag is BLOCK_AGGREGATE once lt and gt, the numbers of elements
+// of the block smaller and greater than the pivot, are set, and BLOCK_PREFIX once ltprefix and
+// gtprefix, the same numbers for the block and all the blocks before it, are set.
+// written is set once the elements of the block are in their place.
+#define BLOCK_EMPTY     0
+#define BLOCK_AGGREGATE 1
+#define BLOCK_PREFIX    2
+
+typedef struct block_status {
+	uint flag, lt, gt, ltprefix, gtprefix, written;
+	block_status() : flag(BLOCK_EMPTY), lt(0), gt(0), ltprefix(0), gtprefix(0), written(0) {}
+} block_status;
+
+// The half-memory mode partitions through a scratch area much smaller than the input, so it moves
+// data with two more kinds of records, each processed by one work group:
+// copy record moves [start, end) of the scratch area, beginning at sstart, back to the same range
+// of the input array;
+typedef struct copy_record {
+	uint start, end, sstart;
+	copy_record() : start(0), end(0), sstart(0) {}
+	copy_record(uint s, uint e, uint ss) : start(s), end(e), sstart(ss) {}
+} copy_record;
+
+// reverse record swaps the element pairs [from, to) of the reversal of [start, end), i.e.
+// element start + i with element end - 1 - i for from <= i < to.
+typedef struct reverse_record {
+	uint start, end, from, to;
+	reverse_record() : start(0), end(0), from(0), to(0) {}
+	reverse_record(uint s, uint e, uint f, uint t) : start(s), end(e), from(f), to(t) {}
+} reverse_record;
 #endif // QUICKSORT_H
@@ -0,0 +1,145 @@
+/*
+Copyright (c) 2014-2019, Intel Corporation
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+* Redistributions of source code must retain the above copyright 
+      notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above 
+      copyright notice, this list of conditions and the following 
+      disclaimer in the documentation and/or other materials provided 
+      with the distribution.
+      * Neither the name of Intel Corporation nor the names of its 
+      contributors may be used to endorse or promote products 
+      derived from this software without specific prior written 
+      permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// QuicksortFileMain.cpp : quicksort-file sorts a raw binary file of keys in place.
+//
+// The file is memory mapped and the mapping becomes the d buffer of GPUQSort (use_host_ptr), so
+// on CPU devices the data is never read into a temporary array nor written back from one.
+// With USE_USM GPUQSort copies d to a device allocation, so the mapping only saves the file I/O.
+//
+#include "GPUQSort.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <limits.h>
+
+const char sUsageString[] =
+	"Usage: quicksort-file <file> <uint|float|double|ulong> [cpu|gpu] [intel|amd|nvidia]\n"
+	"       quicksort-file --generate <num elements> <file> <uint|float|double|ulong>";
+
+template <class T>
+int SortFile(OCLResources* pOCL, const char* pFileName, const std::string& type_name)
+{
+	double beginClock, endClock;
+
+	if (!BuildKernels<T>(pOCL, type_name)) {
+		std::cerr << "Failed to build the kernels for type " << type_name << std::endl;
+		return -1;
+	}
+
+	beginClock = seconds();
+	MappedFile file;
+	if (!MapFile(pFileName, &file)) {
+		std::cerr << "Failed to map " << pFileName << std::endl;
+		return -1;
+	}
+	T* pArray = (T*)file.pData;
+	size_t arraySize = file.fileSize/sizeof(T);
+	// GPUQSort indexes with uint
+	if (file.fileSize/sizeof(T) > UINT_MAX) {
+		std::cerr << pFileName << " has more than " << UINT_MAX << " elements of type " << type_name << std::endl;
+		UnmapFile(&file);
+		return -1;
+	}
+	endClock = seconds();
+	std::cout << "Mapped " << arraySize << " elements of type " << type_name << ": " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+
+	if (arraySize > 1) {
+#ifdef HALF_MEMORY
+		// GPUQSort does not use dn
+		T* pArrayCopy = NULL;
+#else
+#ifdef _MSC_VER
+		T* pArrayCopy = (T*)_aligned_malloc (((arraySize*sizeof(T))/64 + 1)*64, 4096);
+#else // _MSC_VER
+		T* pArrayCopy = (T*)aligned_alloc (4096, ((arraySize*sizeof(T))/64 + 1)*64);
+#endif // _MSC_VER
+#endif // HALF_MEMORY
+		beginClock = seconds();
+		GPUQSort(pOCL, arraySize, pArray, pArrayCopy);
+		endClock = seconds();
+		std::cout << "Time to sort: " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+#ifdef _MSC_VER
+		_aligned_free(pArrayCopy);
+#else // _MSC_VER
+		free(pArrayCopy);
+#endif // _MSC_VER
+	}
+#ifdef TRUST_BUT_VERIFY
+	bool correct = std::is_sorted(pArray, pArray + arraySize);
+	std::cout << "verifying: " << std::boolalpha << correct << std::endl;
+#else
+	bool correct = true;
+#endif
+
+	beginClock = seconds();
+	if (!UnmapFile(&file)) {
+		std::cerr << "Failed to write " << pFileName << " back" << std::endl;
+		return -1;
+	}
+	endClock = seconds();
+	std::cout << "Time to unmap: " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+	return correct ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc == 5 && std::string(argv[1]) == "--generate") {
+		unsigned long long num = strtoull(argv[2], NULL, 10);
+		std::string type_name = argv[4];
+		if (type_name == "uint")	return GenerateKeyFile<uint>(num, argv[3]);
+		if (type_name == "float")	return GenerateKeyFile<float>(num, argv[3]);
+		if (type_name == "double")	return GenerateKeyFile<double>(num, argv[3]);
+		if (type_name == "ulong")	return GenerateKeyFile<cl_ulong>(num, argv[3]);
+		std::cerr << sUsageString << std::endl;
+		return -1;
+	}
+	if (argc < 3 || argc > 5) {
+		std::cerr << sUsageString << std::endl;
+		return -1;
+	}
+
+	OCLResources	myOCL;
+	std::string		type_name = argv[2];
+	const char*		pDeviceStr = argc > 3 ? argv[3] : "gpu";
+	const char*		pVendorStr = argc > 4 ? argv[4] : "intel";
+
+	InitOCLResources(&myOCL, pDeviceStr, pVendorStr);
+
+	if (type_name == "uint")	return SortFile<uint>(&myOCL, argv[1], type_name);
+	if (type_name == "float")	return SortFile<float>(&myOCL, argv[1], type_name);
+	if (type_name == "double")	return SortFile<double>(&myOCL, argv[1], type_name);
+	if (type_name == "ulong")	return SortFile<cl_ulong>(&myOCL, argv[1], type_name);
+	std::cerr << sUsageString << std::endl;
+	return -1;
+}
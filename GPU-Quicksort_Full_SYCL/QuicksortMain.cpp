@@ -44,80 +44,21 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <time.h>
 #include <unistd.h>
 #endif
-#include "OpenCLUtils.h"
+#include "GPUQSort.h"
 #include <math.h>
 #include <iostream>
 #include <algorithm>
 #include <iterator>
 #include <vector>
 #include <map>
+#include <future>
+#include <chrono>
 
 #include "tbb/parallel_sort.h"
-using namespace cl::sycl;
 
-/* Classes can inherit from the device_selector class to allow users
- * to dictate the criteria for choosing a device from those that might be
- * present on a system. This example looks for a device with SPIR support
- * and prefers GPUs over CPUs. */
-class intel_gpu_selector : public device_selector {
- public:
-  intel_gpu_selector() : device_selector() {}
-
-  /* The selection is performed via the () operator in the base
-   * selector class.This method will be called once per device in each
-   * platform. Note that all platforms are evaluated whenever there is
-   * a device selection. */
-  int operator()(const device& device) const override {
-    /* We only give a valid score to devices that support SPIR. */
-    //if (device.has_extension(cl::sycl::string_class("cl_khr_spir"))) {
-    if (device.get_info<info::device::name>().find("Intel") != std::string::npos) {
-      if (device.get_info<info::device::device_type>() ==
-          info::device_type::gpu) {
-        return 50;
-      }
-    }
-    /* Devices with a negative score will never be chosen. */
-    return -1;
-  }
-};
-
-// Types:
-#ifdef min
-#undef min
-#endif
-#ifdef max
-#undef max
-#endif
 #define READ_ALIGNMENT  4096 // Intel recommended alignment
 #define WRITE_ALIGNMENT 4096 // Intel recommended alignment
 
-/// return a timestamp with sub-second precision 
-/** QueryPerformanceCounter and clock_gettime have an undefined starting point (null/zero)     
- *  and can wrap around, i.e. be nulled again. **/ 
-double seconds() { 
-#ifdef _MSC_VER   
-  static LARGE_INTEGER frequency;   
-  if (frequency.QuadPart == 0)     ::QueryPerformanceFrequency(&frequency);   
-  LARGE_INTEGER now;   
-  ::QueryPerformanceCounter(&now);   
-  return now.QuadPart / double(frequency.QuadPart); 
-#else   
-  struct timespec now;   
-  clock_gettime(CLOCK_MONOTONIC, &now);   
-  return now.tv_sec + now.tv_nsec / 1000000000.0; 
-#endif 
-}
- 
-typedef struct
-{	
-	// CL platform handles:
-	cl_device_id		deviceID;
-	cl_context			contextHdl;
-	cl_program			programHdl;
-	cl_command_queue	cmdQHdl;
-	cl::sycl::queue     queue;
-} OCLResources;
-
 // Globals:
 /* Create variable to store OpenCL errors. */
 ::cl_int		ciErrNum = 0;
@@ -162,53 +103,11 @@ void parseArgs(OCLResources* pOCL, int argc, char** argv, unsigned int* test_ite
   sprintf (pDeviceStr, "%s", pDeviceWStr.c_str());
   sprintf (pVendorStr, "%s", pVendorWStr.c_str());
 
-  auto get_queue = [&pDeviceStr, &pVendorStr]() {  
-    device_selector* pds = 0;
-    if (pVendorStr == std::string("intel")) {
-      if (pDeviceStr == std::string("gpu")) {
-          static intel_gpu_selector selector;
-		  pds = &selector;
-	  } else if (pDeviceStr == std::string("cpu")) {
-		  static cpu_selector selector;
-		  pds = &selector;
-	  }
-	} else {
-		static default_selector selector;
-		pds = &selector;
-	}
-
-    device d(*pds);
-
-    queue queue(*pds, [](cl::sycl::exception_list l) {
-      for (auto ep : l) {
-        try {
-          std::rethrow_exception(ep);
-        } catch (cl::sycl::exception& e) {
-          std::cout << e.what() << std::endl;
-        }
-      }
-    });
-    return queue;
-  };
-  
-  auto queue = get_queue();
-  pOCL->queue = queue;
-  /* Retrieve the underlying cl_context of the context associated with the
-   * queue. */
-  pOCL->contextHdl = queue.get_context().get();
-
-  /* Retrieve the underlying cl_device_id of the device asscociated with the
-   * queue. */
-  pOCL->deviceID = queue.get_device().get();
-
-  /* Retrieve the underlying cl_command_queue of the queue. */
-  pOCL->cmdQHdl = queue.get();
+  InitOCLResources(pOCL, pDeviceStr, pVendorStr);
 }
 
-//#define GET_DETAILED_PERFORMANCE 1
 #define RUN_CPU_SORTS
-#define HOST 1
-#include "Quicksort.h"
+#define RUN_HETERO_SORTS
 
 template <class T>
 T* partition(T* left, T* right, T pivot) {
@@ -258,653 +157,6 @@ void quicksort(T* data, int left, int right)
 	}
 }
 
-template <class T>
-void plus_prescan(T *a, T *b) {
-    T av = *a;
-	T bv = *b;
-    *a = bv;
-    *b = bv + av;
-}
-
-// record to push start of the sequence, end of the sequence and direction of sorting on internal stack
-struct workstack_record {
-	uint start;
-	uint end;
-	uint direction;
-};
-
-//---------------------------------------------------------------------------------------
-// Class implements the last stage of GPU-Quicksort, when all the subsequences are small
-// enough to be processed in local memory. It uses similar algorithm to gqsort_kernel to 
-// move items around the pivot and then switches to bitonic sort for sequences in
-// the range [1, SORT_THRESHOLD] 
-//
-// d - input array
-// dn - scratch array of the same size as the input array
-// seqs - array of records to be sorted in a local memory, one sequence per work group.
-//---------------------------------------------------------------------------------------
-template <class T>
-class lqsort_kernel_class {
-	public:
-    static cl::sycl::kernel* kernel;
-
-	using discard_read_write_accessor = 
-	  accessor<T, 1, access::mode::discard_read_write, access::target::global_buffer>;
-	using seqs_read_accessor = accessor<work_record<T>, 1, access::mode::read, access::target::global_buffer>;
-	
-    using local_uint_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::local>;
-    using local_int_read_write_accessor = accessor<int, 1, access::mode::read_write, access::target::local>;
-    using local_T_read_write_accessor = accessor<T, 1, access::mode::read_write, access::target::local>;
-    using local_workstack_record_read_write_accessor = accessor<workstack_record, 1, access::mode::read_write, access::target::local>;
-
-    lqsort_kernel_class(discard_read_write_accessor db,
-	                    discard_read_write_accessor dnb, 
-						seqs_read_accessor seqsb,
-						local_workstack_record_read_write_accessor workstackb,
-						local_int_read_write_accessor workstack_pointerb,
-						local_T_read_write_accessor mysb, 
-						local_T_read_write_accessor mysnb, 
-						local_T_read_write_accessor tempb,
-						local_uint_read_write_accessor ltsumb,
-						local_uint_read_write_accessor gtsumb,
-						local_uint_read_write_accessor ltb,
-						local_uint_read_write_accessor gtb) :
-						d(db), dn(dnb), seqs(seqsb) ,
-						workstack(workstackb),
-						workstack_pointer(workstack_pointerb),
-						mys(mysb), mysn(mysnb), temp(tempb),
-						ltsum(ltsumb), gtsum(gtsumb),
-						lt(ltb), gt(gtb) 
-						 {}
-
-    /// bitonic_sort: sort 2*LOCAL_THREADCOUNT elements
-    void bitonic_sort(local_ptr<T> sh_data, const uint localid, nd_item<1> id)
-    {
-    	for (uint ulevel = 1; ulevel < LQSORT_LOCAL_WORKGROUP_SIZE; ulevel <<= 1) {
-            for (uint j = ulevel; j > 0; j >>= 1) {
-                uint pos = 2*localid - (localid & (j - 1));
-    
-    			uint direction = localid & ulevel;
-    			uint av = sh_data[pos], bv = sh_data[pos + j];
-    			const uint sortThem = av > bv;
-    			const uint greater = cl::sycl::select(bv, av, sortThem);
-    			const uint lesser  = cl::sycl::select(av, bv, sortThem);
-    
-    			sh_data[pos]     = cl::sycl::select(lesser, greater, direction);
-    			sh_data[pos + j] = cl::sycl::select(greater, lesser, direction);
-				id.barrier(access::fence_space::local_space);
-            }
-        }
-    
-    	for (uint j = LQSORT_LOCAL_WORKGROUP_SIZE; j > 0; j >>= 1) {
-            uint pos = 2*localid - (localid & (j - 1));
-    
-    		uint av = sh_data[pos], bv = sh_data[pos + j];
-    		const uint sortThem = av > bv;
-    		sh_data[pos]      = cl::sycl::select(av, bv, sortThem);
-    		sh_data[pos + j]  = cl::sycl::select(bv, av, sortThem);
-    
-		    id.barrier(access::fence_space::local_space);
-        }
-    }
-
-    void sort_threshold(local_ptr<T> data_in, 
-	                    global_ptr<T> data_out,
-    					uint start, 
-    					uint end, local_ptr<T> temp_, uint localid,
-						nd_item<1> id) 
-    {
-    	uint tsum = end - start;
-    	if (tsum == SORT_THRESHOLD) {
-    		bitonic_sort(data_in+start, localid, id);
-    		for (uint i = localid; i < SORT_THRESHOLD; i += LQSORT_LOCAL_WORKGROUP_SIZE) {
-    			data_out[start + i] = data_in[start + i];
-    		}
-    	} else if (tsum > 1) {
-    		for (uint i = localid; i < SORT_THRESHOLD; i += LQSORT_LOCAL_WORKGROUP_SIZE) {
-    			if (i < tsum) {
-    				temp_[i] = data_in[start + i];
-    			} else {
-    				temp_[i] = std::numeric_limits<T>::max();
-    			}
-    		}
-		    id.barrier(access::fence_space::local_space);
-    		bitonic_sort(temp_, localid, id);
-    
-    		for (uint i = localid; i < tsum; i += LQSORT_LOCAL_WORKGROUP_SIZE) {
-    			data_out[start + i] = temp_[i];
-    		}
-    	} else if (tsum == 1 && localid == 0) {
-    		data_out[start] = data_in[start];
-    	} 
-    }
-
-#define PUSH(START, END) 			if (localid == 0) { \
-										workstack_pointer[0] ++; \
-                                        workstack_record wr{ (START), (END), direction ^ 1 }; \
-										workstack[workstack_pointer[0]] = wr; \
-									} \
-									id.barrier(access::fence_space::local_space);
-
-
-    void operator()(nd_item<1> id) {
-		const size_t blockid = id.get_group(0);
-        const size_t localid = id.get_local_id(0);
-
-        local_ptr<T> s, sn;
-	    uint i, ltp, gtp;
-		T tmp;
-	
-    	work_record<T> block = seqs[blockid];
-    	const uint d_offset = block.start;
-    	uint start = 0; 
-    	uint end   = block.end - d_offset;
-    
-    	uint direction = 1; // which direction to sort
-    	// initialize workstack and workstack_pointer: push the initial sequence on the stack
-    	if (localid == 0) {
-    		workstack_pointer[0] = 0; // beginning of the stack
-    		workstack_record wr{ start, end, direction };
-    		workstack[0] = wr;
-    	}
-    	// copy block of data to be sorted by one workgroup into local memory
-    	// note that indeces of local data go from 0 to end-start-1
-    	if (block.direction == 1) {
-    		for (i = localid; i < end; i += LQSORT_LOCAL_WORKGROUP_SIZE) {
-    			mys[i] = d[i+d_offset];
-    		}
-    	} else {
-    		for (i = localid; i < end; i += LQSORT_LOCAL_WORKGROUP_SIZE) {
-    			mys[i] = dn[i+d_offset];
-    		}
-    	}
-		id.barrier(access::fence_space::local_space);
-
-        while (workstack_pointer[0] >= 0) { 
-    		// pop up the stack
-    		workstack_record wr = workstack[workstack_pointer[0]];
-    		start = wr.start;
-    		end = wr.end;
-    		direction = wr.direction;
-    		if (localid == 0) {
-    			workstack_pointer[0] --;
-    
-    			ltsum[0] = gtsum[0] = 0;	
-    		}
-    		if (direction == 1) {
-    			s = mys.get_pointer();
-    			sn = mysn.get_pointer();
-    		} else {
-    			s = mysn.get_pointer();
-    			sn = mys.get_pointer();
-    		}
-    		// Set thread local counters to zero
-    		lt[localid] = gt[localid] = 0;
-    		ltp = gtp = 0;
-		    id.barrier(access::fence_space::local_space);
-    
-    		// Pick a pivot
-    		T pivot = s[start];
-    		if (start < end) {
-    			pivot = median_select(pivot, s[(start+end) >> 1], s[end-1]);
-    		}
-    		// Align work item accesses for coalesced reads.
-    		// Go through data...
-    		for(i = start + localid; i < end; i += LQSORT_LOCAL_WORKGROUP_SIZE) {
-    			tmp = s[i];
-    			// counting elements that are smaller ...
-    			if (tmp < pivot)
-    				ltp++;
-    			// or larger compared to the pivot.
-    			if (tmp > pivot) 
-    				gtp++;
-    		}
-    		lt[localid] = ltp;
-    		gt[localid] = gtp;
-		    id.barrier(access::fence_space::local_space);
-    		
-    		// calculate cumulative sums
-    		uint n;
-    		for(i = 1; i < LQSORT_LOCAL_WORKGROUP_SIZE; i <<= 1) {
-    			n = 2*i - 1;
-    			if ((localid & n) == n) {
-    				lt[localid] += lt[localid-i];
-    				gt[localid] += gt[localid-i];
-    			}
-		        id.barrier(access::fence_space::local_space);
-    		}
-    
-    		if ((localid & n) == n) {
-    			lt[LQSORT_LOCAL_WORKGROUP_SIZE] = ltsum[0] = lt[localid];
-    			gt[LQSORT_LOCAL_WORKGROUP_SIZE] = gtsum[0] = gt[localid];
-    			lt[localid] = 0;
-    			gt[localid] = 0;
-    		}
-    		
-    		for(i = LQSORT_LOCAL_WORKGROUP_SIZE/2; i >= 1; i >>= 1) {
-    			n = 2*i - 1;
-    			if ((localid & n) == n) {
-    				plus_prescan(&lt[localid - i], &lt[localid]);
-    				plus_prescan(&gt[localid - i], &gt[localid]);
-    			}
-		        id.barrier(access::fence_space::local_space);
-    		}
-    
-    		// Allocate locations for work items
-    		uint lfrom = start + lt[localid];
-    		uint gfrom = end - gt[localid+1];
-    
-    		// go thru data again writing elements to their correct position
-    		for (i = start + localid; i < end; i += LQSORT_LOCAL_WORKGROUP_SIZE) {
-    			tmp = s[i];
-    			// increment counts
-    			if (tmp < pivot) 
-    				sn[lfrom++] = tmp;
-    			
-    			if (tmp > pivot) 
-    				sn[gfrom++] = tmp;
-    		}
-		    id.barrier(access::fence_space::local_space);
-    
-    		// Store the pivot value between the new sequences
-    		for (i = start + ltsum[0] + localid;i < end - gtsum[0]; i += LQSORT_LOCAL_WORKGROUP_SIZE) {
-    			d[i+d_offset] = pivot;
-    		}
-		    id.barrier(access::fence_space::global_and_local);
-    
-    		// if the sequence is shorter than SORT_THRESHOLD
-    		// sort it using an alternative sort and place result in d
-    		if (ltsum[0] <= SORT_THRESHOLD) {
-    			sort_threshold(sn, d.get_pointer() + d_offset, start, start + ltsum[0], temp.get_pointer(), localid, id);
-    		} else {
-    			PUSH(start, start + ltsum[0])
-    		}
-    		
-    		if (gtsum[0] <= SORT_THRESHOLD) {
-    			sort_threshold(sn, d.get_pointer() + d_offset, end - gtsum[0], end, temp.get_pointer(), localid, id);
-    		} else {
-    			PUSH(end - gtsum[0], end)
-    		}
-    	}
-	}
-
-	private:
-    discard_read_write_accessor d, dn;
-	seqs_read_accessor seqs;
-
-    local_workstack_record_read_write_accessor workstack;
-	local_int_read_write_accessor workstack_pointer;
-	
-	local_T_read_write_accessor mys, mysn, temp;
-
-	local_uint_read_write_accessor ltsum, gtsum;
-	local_uint_read_write_accessor lt, gt;
-};
-
-//----------------------------------------------------------------------------
-// Class implements gqsort_kernel
-//----------------------------------------------------------------------------
-template <class T>
-class gqsort_kernel_class {
-	public:
-    static cl::sycl::kernel* kernel;
-
-	using blocks_read_accessor = accessor<block_record<T>, 1, access::mode::read, access::target::global_buffer>;
-	using parents_read_write_accessor = accessor<parent_record, 1, access::mode::read_write, access::target::global_buffer>;
-	using news_write_accessor = accessor<work_record<T>, 1, access::mode::write, access::target::global_buffer>;
-	using discard_read_write_accessor = 
-	  accessor<T, 1, access::mode::discard_read_write, access::target::global_buffer>;
-    using local_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::local>;
-
-    gqsort_kernel_class(discard_read_write_accessor db,
-	                    discard_read_write_accessor dnb,
-	                    blocks_read_accessor blocksb,
-	                    parents_read_write_accessor parentsb,
-	                    news_write_accessor newsb, 
-						local_read_write_accessor ltb, 
-						local_read_write_accessor gtb, 
-						local_read_write_accessor ltsumb, 
-						local_read_write_accessor gtsumb, 
-						local_read_write_accessor lbegb, 
-						local_read_write_accessor gbegb) :
-						d(db), dn(dnb), blocks(blocksb), 
-						parents(parentsb), news(newsb),
-						lt(ltb), gt(gtb), ltsum(ltsumb), gtsum(gtsumb), lbeg(lbegb), gbeg(gbegb) {}
-
-    void operator()(nd_item<1> id) {
-        const size_t blockid = id.get_group(0);
-        const size_t localid = id.get_local_id(0);
-
-        uint i, lfrom, gfrom, ltp = 0, gtp = 0;
-		T lpivot, gpivot, tmp;
-
-	    // Get the sequence block assigned to this work group
-	    block_record<T> block = blocks[blockid];
-	    uint start = block.start, end = block.end, direction = block.direction;
-		T pivot = block.pivot;
-
-        auto& pparent = parents[block.parent];
-
-	    T *s, *sn;
-
-	    // GPU-Quicksort cannot sort in place, as the regular quicksort algorithm can.
-	    // It therefore needs two arrays to sort things out. We start sorting in the 
-	    // direction of d -> dn and then change direction after each run of gqsort_kernel.
-	    // Which direction we are sorting: d -> dn or dn -> d?
-	    if (direction == 1) {
-	    	s = &d[0];
-	    	sn = &dn[0];
-	    } else {
-	    	s = &dn[0];
-	    	sn = &d[0];
-	    }
-	    // Set thread local counters to zero
-	    lt[localid] = gt[localid] = 0;
-	    id.barrier(access::fence_space::local_space);
-
-	    // Align thread accesses for coalesced reads.
-	    // Go through data...
-	    for(i = start + localid; i < end; i += GQSORT_LOCAL_WORKGROUP_SIZE) {
-	    	tmp = s[i];
-	    	// counting elements that are smaller ...
-	    	if (tmp < pivot)
-	    		ltp++;
-	    	// or larger compared to the pivot.
-	    	if (tmp > pivot) 
-	    		gtp++;
-	    }
-	    lt[localid] = ltp;
-	    gt[localid] = gtp;
-	    id.barrier(access::fence_space::local_space);
-
-    	// calculate cumulative sums
-    	uint n;
-    	for(i = 1; i < GQSORT_LOCAL_WORKGROUP_SIZE; i <<= 1) {
-    		n = 2*i - 1;
-    		if ((localid & n) == n) {
-    			lt[localid] += lt[localid-i];
-    			gt[localid] += gt[localid-i];
-    		}
-	        id.barrier(access::fence_space::local_space);
-    	}
-    
-    	if ((localid & n) == n) {
-    		lt[GQSORT_LOCAL_WORKGROUP_SIZE] = ltsum[0] = lt[localid];
-    		gt[GQSORT_LOCAL_WORKGROUP_SIZE] = gtsum[0] = gt[localid];
-    		lt[localid] = 0;
-    		gt[localid] = 0;
-    	}
-    		
-    	for(i = GQSORT_LOCAL_WORKGROUP_SIZE/2; i >= 1; i >>= 1) {
-    		n = 2*i - 1;
-    		if ((localid & n) == n) {
-    			plus_prescan(&lt[localid - i], &lt[localid]);
-    			plus_prescan(&gt[localid - i], &gt[localid]);
-    		}
-	        id.barrier(access::fence_space::local_space);
-    	}		
-
-	    // Allocate memory in the sequence this block is a part of
-	    if (localid == 0) {
-			cl::sycl::atomic<uint> psstart_a(multi_ptr<uint, access::address_space::global_space>(&pparent.sstart));
-			cl::sycl::atomic<uint> psend_a(multi_ptr<uint, access::address_space::global_space>(&pparent.send));
-	    	// Atomic increment allocates memory to write to.
-	    	lbeg[0] = cl::sycl::atomic_fetch_add(psstart_a, ltsum[0]);
-	    	// Atomic is necessary since multiple blocks access this
-	    	gbeg[0] = cl::sycl::atomic_fetch_sub(psend_a, gtsum[0]) - gtsum[0];
-	    }
-        id.barrier(access::fence_space::global_and_local);
-
-		// Allocate locations for work items
-		lfrom = lbeg[0] + lt[localid];
-		gfrom = gbeg[0] + gt[localid];
-
-       	// go thru data again writing elements to their correct position
-       	for(i = start + localid; i < end; i += GQSORT_LOCAL_WORKGROUP_SIZE) {
-       		tmp = s[i];
-       		// increment counts
-       		if (tmp < pivot) 
-       			sn[lfrom++] = tmp;
-       
-       		if (tmp > pivot) 
-       			sn[gfrom++] = tmp;
-       	}
-        id.barrier(access::fence_space::global_and_local);
-
-    	if (localid == 0) {
-			cl::sycl::atomic<uint> pblockcount_a(multi_ptr<uint, access::address_space::global_space>(&pparent.blockcount));
-    		if (cl::sycl::atomic_fetch_sub(pblockcount_a, (uint)1) == 0) {
-    			uint sstart = pparent.sstart;
-    			uint send = pparent.send;
-    			uint oldstart = pparent.oldstart;
-    			uint oldend = pparent.oldend;
-    
-    			// Store the pivot value between the new sequences
-    			for(i = sstart; i < send; i ++) {
-    				d[i] = pivot;
-    			}
-    
-    			lpivot = sn[oldstart];
-    			gpivot = sn[oldend-1];
-    			if (oldstart < sstart) {
-    				lpivot = median_select(lpivot,sn[(oldstart+sstart) >> 1], sn[sstart-1]);
-    			} 
-    			if (send < oldend) {
-    				gpivot = median_select(sn[send],sn[(oldend+send) >> 1], gpivot);
-    			}
-    			
-    			// change the direction of the sort.
-    			direction ^= 1;
-    
-    			news[2*blockid] = work_record<T>{oldstart, sstart, lpivot, direction};
-    			news[2*blockid + 1] = work_record<T>{send, oldend, gpivot, direction};
-    		}
-    	}
-	}
-	private:
-      discard_read_write_accessor d, dn;
-	  blocks_read_accessor blocks;
-	  parents_read_write_accessor parents;
-	  news_write_accessor news;
-	  local_read_write_accessor lt, gt, ltsum, gtsum, lbeg, gbeg;
-};
-
-// Note that for every type that we intend to sort we need to allocate this
-template <>
-cl::sycl::kernel* gqsort_kernel_class<uint>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
-template <>
-cl::sycl::kernel* lqsort_kernel_class<uint>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
-template <>
-cl::sycl::kernel* gqsort_kernel_class<float>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
-template <>
-cl::sycl::kernel* lqsort_kernel_class<float>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
-template <>
-cl::sycl::kernel* gqsort_kernel_class<double>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
-template <>
-cl::sycl::kernel* lqsort_kernel_class<double>::kernel = (cl::sycl::kernel*)malloc(sizeof(cl::sycl::kernel));
-
-template <class T>
-void gqsort(OCLResources *pOCL, 
-            buffer<T>& d_buffer, 
-			buffer<T>& dn_buffer, 
-			std::vector<block_record<T>>& blocks, 
-			std::vector<parent_record>& parents, 
-			std::vector<work_record<T>>& news, 
-			bool reset) {
-#ifdef GET_DETAILED_PERFORMANCE
-	static double absoluteTotal = 0.0;
-	static uint count = 0;
-
-	if (reset) {
-		absoluteTotal = 0.0;
-		count = 0;
-	}
-
-	double beginClock, endClock;
-  beginClock = seconds();
-#endif
-
-	news.resize(blocks.size()*2);
-	// Create buffer objects for memory.
-	buffer<block_record<T>>  blocks_buffer(blocks.data(), blocks.size(), {property::buffer::use_host_ptr()});
-	buffer<parent_record>  parents_buffer(parents.data(), parents.size(), {property::buffer::use_host_ptr()});
-	buffer<work_record<T>>  news_buffer(news.data(), news.size(), {property::buffer::use_host_ptr()});
-
-    pOCL->queue.submit([&](handler& cgh) {
-		using local_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::local>;
-	  auto db = d_buffer.template get_access<access::mode::discard_read_write>(cgh);
-	  auto dnb = dn_buffer.template get_access<access::mode::discard_read_write>(cgh);
-	  auto blocksb = blocks_buffer.template get_access<access::mode::read>(cgh);
-	  auto parentsb = parents_buffer.get_access<access::mode::read_write>(cgh);
-	  auto newsb = news_buffer. template get_access<access::mode::write>(cgh);
-
-	  local_read_write_accessor
-        lt(range<>(GQSORT_LOCAL_WORKGROUP_SIZE+1), cgh), gt(range<>(GQSORT_LOCAL_WORKGROUP_SIZE+1), cgh),
-	    ltsum(range<>(1), cgh), gtsum(range<>(1), cgh), lbeg(range<>(1), cgh), gbeg(range<>(1), cgh);
-     
-      auto gqsort = gqsort_kernel_class<T>(db, dnb, blocksb, parentsb, newsb, lt, gt, ltsum, gtsum, lbeg, gbeg);
-
-      cgh.parallel_for(
-        *gqsort.kernel,
-		nd_range<>(GQSORT_LOCAL_WORKGROUP_SIZE * blocks.size(), 
-	               GQSORT_LOCAL_WORKGROUP_SIZE), 
-	    gqsort);
-    });
-    pOCL->queue.wait_and_throw();
-
-#ifdef GET_DETAILED_PERFORMANCE
-    endClock = seconds();
-	double totalTime = endClock - beginClock;
-	absoluteTotal += totalTime;
-	std::cout << ++count << ": gqsort time " << absoluteTotal * 1000 << " ms" << std::endl;
-#endif
-}
-
-template <class T>
-void lqsort(OCLResources *pOCL, 
-            std::vector<work_record<T>>& done, 
-			buffer<T>& d_buffer, 
-			buffer<T>& dn_buffer) {
-#ifdef GET_DETAILED_PERFORMANCE
-    double beginClock, endClock;
-    beginClock = seconds();
-#endif
-
-	buffer<work_record<T>>  done_buffer(done.data(), done.size(), {property::buffer::use_host_ptr()});
-
-    pOCL->queue.submit([&](handler& cgh) {
-		using local_workstack_record_read_write_accessor = accessor<workstack_record, 1, access::mode::read_write, access::target::local>;
-		using local_T_read_write_accessor = accessor<T, 1, access::mode::read_write, access::target::local>;
-		using local_uint_read_write_accessor = accessor<uint, 1, access::mode::read_write, access::target::local>;
-		using local_int_read_write_accessor = accessor<int, 1, access::mode::read_write, access::target::local>;
-
-      auto db = d_buffer.template get_access<access::mode::discard_read_write>(cgh);
-	  auto dnb = dn_buffer.template get_access<access::mode::discard_read_write>(cgh);
-      auto doneb = done_buffer.template get_access<access::mode::read>(cgh);
-
-	  local_workstack_record_read_write_accessor workstack(range<>(QUICKSORT_BLOCK_SIZE/SORT_THRESHOLD), cgh);
-	  local_int_read_write_accessor workstack_pointer(range<>(1), cgh);
-	  local_uint_read_write_accessor ltsum(range<>(1), cgh), gtsum(range<>(1), cgh),
-		  lt(range<>(LQSORT_LOCAL_WORKGROUP_SIZE+1), cgh), gt(range<>(LQSORT_LOCAL_WORKGROUP_SIZE+1), cgh);
-      local_T_read_write_accessor mys(range<>(QUICKSORT_BLOCK_SIZE), cgh), mysn(range<>(QUICKSORT_BLOCK_SIZE), cgh),
-          temp(range<>(SORT_THRESHOLD), cgh);
- 
- 
-	  auto lqsort = lqsort_kernel_class<T>(db, dnb, doneb,
-	      workstack, workstack_pointer, mys, mysn, temp, ltsum, gtsum, lt, gt);
-
-      cgh.parallel_for(
-		*lqsort.kernel,
-		nd_range<>(LQSORT_LOCAL_WORKGROUP_SIZE * done.size(), 
-	               LQSORT_LOCAL_WORKGROUP_SIZE), 
-	    lqsort);
-    });
-    pOCL->queue.wait_and_throw();
-
-#ifdef GET_DETAILED_PERFORMANCE
-	endClock = seconds();
-	double totalTime = endClock - beginClock;
-	std::cout << "lqsort time " << totalTime * 1000 << " ms" << std::endl;
-#endif
-}
-
-size_t optp(size_t s, double k, size_t m) {
-	return (size_t)pow(2, floor(log(s*k + m)/log(2.0) + 0.5));
-}
-
-template <class T>
-void GPUQSort(OCLResources *pOCL, size_t size, T* d, T* dn)  {
-	// allocate buffers
-	buffer<T>  d_buffer(d, size, {property::buffer::use_host_ptr()});
-	buffer<T>  dn_buffer(dn, size, {property::buffer::use_host_ptr()});
-
-	const size_t MAXSEQ = optp(size, 0.00009516, 203);
-	const size_t MAX_SIZE = 12*std::max(MAXSEQ, (size_t)QUICKSORT_BLOCK_SIZE);
-	//std::cout << "MAXSEQ = " << MAXSEQ << std::endl;
-	T startpivot = median(d[0], d[size/2], d[size-1]);
-	std::vector<work_record<T>> work, done, news;
-	work.reserve(MAX_SIZE);
-	done.reserve(MAX_SIZE);
-	news.reserve(MAX_SIZE);
-	std::vector<parent_record> parent_records;
-	parent_records.reserve(MAX_SIZE);
-	std::vector<block_record<T>> blocks;
-	blocks.reserve(MAX_SIZE);
-	
-	work.push_back(work_record<T>(0, size, startpivot, 1));
-
-	bool reset = true;
-
-	while(!work.empty() /*&& work.size() + done.size() < MAXSEQ*/) {
-		size_t blocksize = 0;
-		
-		for(auto it = work.begin(); it != work.end(); ++it) {
-			blocksize += std::max((it->end - it->start)/MAXSEQ, (size_t)1);
-		}
-		for(auto it = work.begin(); it != work.end(); ++it) {
-			uint start = it->start;
-			uint end   = it->end;
-			T pivot = it->pivot;
-			uint direction = it->direction;
-			uint blockcount = (end - start + blocksize - 1)/blocksize;
-			parent_record prnt(start, end, start, end, blockcount-1);
-			parent_records.push_back(prnt);
-
-			for(uint i = 0; i < blockcount - 1; i++) {
-				uint bstart = start + blocksize*i;
-				block_record<T> br(bstart, bstart+blocksize, pivot, direction, parent_records.size()-1);
-				blocks.push_back(br);
-			}
-			block_record<T> br(start + blocksize*(blockcount - 1), end, pivot, direction, parent_records.size()-1);
-			blocks.push_back(br);
-		}
-
-		gqsort(pOCL, d_buffer, dn_buffer, blocks, parent_records, news, reset);
-		reset = false;
-		//std::cout << " blocks = " << blocks.size() << " parent records = " << parent_records.size() << " news = " << news.size() << std::endl;
-		work.clear();
-		parent_records.clear();
-		blocks.clear();
-		for(auto it = news.begin(); it != news.end(); ++it) {
-			if (it->direction != EMPTY_RECORD) {
-				if (it->end - it->start <= QUICKSORT_BLOCK_SIZE /*size/MAXSEQ*/) {
-					if (it->end - it->start > 0)
-						done.push_back(*it);
-				} else {
-					work.push_back(*it);
-				}
-			}
-		}
-		news.clear();
-	}
-	for(auto it = work.begin(); it != work.end(); ++it) {
-		if (it->end - it->start > 0)
-			done.push_back(*it);
-	}
-
-	lqsort(pOCL, done, d_buffer, dn_buffer);
-}
-
 void QueryPrintDeviceInfo(queue& q) {
 	auto vendor = q.get_device().get_info<info::device::vendor>();
     auto name = q.get_device().get_info<info::device::name>();
@@ -954,9 +206,21 @@ void QueryPrintDeviceInfo(queue& q) {
 	CheckCLError (ciErrNum, "clGetSupportedImageFormats() query failed.", "clGetSupportedImageFormats() query success")
 }
 
+// Frees an array of big_test
+template <class T>
+void FreeArray(T* pArray)
+{
+#ifdef _MSC_VER
+	_aligned_free(pArray);
+#else // _MSC_VER
+	free(pArray);
+#endif // _MSC_VER
+}
+
 template <class T>
 int big_test(OCLResources& myOCL, uint arraySize, unsigned int	NUM_ITERATIONS, 
-             const char* pDeviceStr, const std::string& type_name) 
+             const char* pDeviceStr, const std::string& type_name,
+             std::shared_future<bool> kernels_ready) 
 {
 	double totalTime, quickSortTime, stdSortTime;
 
@@ -1028,95 +292,41 @@ int big_test(OCLResources& myOCL, uint arraySize, unsigned int	NUM_ITERATIONS,
 	std::vector<T> original(arraySize);
 	std::copy(pArray, pArray + arraySize, original.begin());
 
-    // Let's prebuild SYCL program
-	cl::sycl::program program(myOCL.contextHdl);
-    totalTime = 0;
-//#define SWAP_ORDER 1
-#ifdef SWAP_ORDER
-goto try_me_first;
-try_me_second:
-#endif
-	try {
-      bool has_it = false;
-	  try {
-	    has_it = program.has_kernel<lqsort_kernel_class<T>>();
-	  } catch (...) {}
-
-	  if (has_it)
-	    std::cout << "No need to build! We will just get it!" << std::endl;
-      else { 
-	    std::cout << "before program.build_with_kernel_type<lqsort_kernel_class<T>>();\n";
-	    beginClock = seconds();
-        program.build_with_kernel_type<lqsort_kernel_class<T>>();
-        endClock = seconds();
-	    totalTime += endClock - beginClock;
-	    //cl_program p = program.get();
-	    //BuildFailLog(p, myOCL.deviceID);
-        std::cout << "after program.build_with_kernel_type<lqsort_kernel_class<T>>();\n";
-	    std::cout << "Time to build SYCL Program: " << totalTime * 1000 << " ms" << std::endl;
-	  }
-       new (lqsort_kernel_class<T>::kernel) cl::sycl::kernel(program.get_kernel<lqsort_kernel_class<T>>());
-	  std::cout << "Successfully acquired lqsort_kernel_class<T>!" << std::endl;
-	} catch (const cl::sycl::exception& e) {
-	  std::cerr << "SYCL exception caught: " << e.what() << "\n";
-	  return 1;
-	} catch (const std::exception& e) {
-	  std::cerr << "C++ exception caught: " << e.what() << "\n";
-	  return 2;
-	}
-#ifdef SWAP_ORDER
-goto report_total_time;
-try_me_first:
-#endif
-	try {
-	  bool has_it = false;
-	  try { 
-		has_it = program.has_kernel<gqsort_kernel_class<T>>();
-	  } catch (...) { std::cout << "Caught something!" << std::endl; }
-
-	  if (has_it)
-	    std::cout << "No need to build! We will just get it!" << std::endl;
-      else {
-	    std::cout << "before program.build_with_kernel_type<gqsort_kernel_class<T>>();\n";
-	    beginClock = seconds();
-        program.build_with_kernel_type<gqsort_kernel_class<T>>();
-        endClock = seconds();
-	    totalTime += endClock - beginClock;
-	    //cl_program p = program.get();
-	    //BuildFailLog(p, myOCL.deviceID);
-        std::cout << "after program.build_with_kernel_type<gqsort_kernel_class<T>>();\n";
-	    std::cout << "Time to build SYCL Program: " << totalTime * 1000 << " ms" << std::endl;
-	  }
-      new (gqsort_kernel_class<T>::kernel) cl::sycl::kernel(program.get_kernel<gqsort_kernel_class<T>>());
-	  std::cout << "Successfully acquired gqsort_kernel_class<T>!" << std::endl;
-	} catch (const cl::sycl::exception& e) {
-	  std::cerr << "SYCL exception caught: " << e.what() << "\n";
-	  return 1;
-	} catch (const std::exception& e) {
-	  std::cerr << "C++ exception caught: " << e.what() << "\n";
-	  return 2;
-	}
-#ifdef SWAP_ORDER
-goto try_me_second;
-report_total_time:
-#endif
-
+	// the statistics are of the sorts on the device only: the host sorts are timed on their own
 	std::vector<double> times;
-	times.resize(NUM_ITERATIONS);
-	double AverageTime = 0.0;
+	double AverageTime = 0.0, hostTime = 0.0;
 	uint num_failures = 0;
+	uint num_host_sorts = 0;
 	for(uint k = 0; k < NUM_ITERATIONS; k++) {
 		std::copy(original.begin(), original.end(), pArray);
 		std::vector<T> verify(arraySize);
 		std::copy(pArray, pArray + arraySize, verify.begin());
 
+		// Until the kernels for this type are built, sort on the host instead of waiting for them
+		bool on_device = kernels_ready.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		if (on_device && !kernels_ready.get()) {
+			std::cerr << "Failed to build the kernels for type " << type_name << std::endl;
+			FreeArray(pArray);
+			FreeArray(pArrayCopy);
+			return 1;
+		}
+
 		beginClock = seconds();
-		GPUQSort(&myOCL, arraySize, pArray, pArrayCopy);
+		if (on_device) {
+			GPUQSort(&myOCL, arraySize, pArray, pArrayCopy);
+		} else {
+			tbb::parallel_sort(pArray, pArray + arraySize);
+			num_host_sorts++;
+		}
 		endClock = seconds();
 		totalTime = endClock - beginClock;
-		std::cout << "Time to sort: " << totalTime * 1000 << " ms" << std::endl;
-		times[k] = totalTime;
-		AverageTime += totalTime;
+		std::cout << "Time to sort" << (on_device ? "" : " on the host (kernels are still building)") << ": " << totalTime * 1000 << " ms" << std::endl;
+		if (on_device) {
+			times.push_back(totalTime);
+			AverageTime += totalTime;
+		} else {
+			hostTime += totalTime;
+		}
 #ifdef TRUST_BUT_VERIFY
 		std::cout << "verifying: ";
 		std::sort(verify.begin(), verify.end());
@@ -1138,40 +348,182 @@ report_total_time:
 #endif
 	}
 	std::cout << " Number of failures: " << num_failures << " out of " << NUM_ITERATIONS << std::endl;
-	AverageTime = AverageTime/NUM_ITERATIONS; 
+	if (num_host_sorts) {
+		std::cout << " Sorted on the host while the kernels were building: " << num_host_sorts << " out of " << NUM_ITERATIONS << std::endl;
+		std::cout << "Average Time on the host: " << hostTime/num_host_sorts * 1000 << " ms" << std::endl;
+	}
+	const size_t num_device_sorts = times.size();
+	if (num_device_sorts == 0) {
+		std::cout << "No sorts on the device: the kernels were building throughout" << std::endl;
+		printf("-------done--------------------------------------------------------\n");
+		FreeArray(pArray);
+		FreeArray(pArrayCopy);
+		return 0;
+	}
+	AverageTime = AverageTime/num_device_sorts; 
 	std::cout << "Average Time: " << AverageTime * 1000 << " ms" << std::endl;
 	double stdDev = 0.0, minTime = 1000000.0, maxTime = 0.0;
-	for(uint k = 0; k < NUM_ITERATIONS; k++) 
+	for(size_t k = 0; k < num_device_sorts; k++) 
 	{
 		stdDev += (AverageTime - times[k])*(AverageTime - times[k]);
 		minTime = std::min(minTime, times[k]);
 		maxTime = std::max(maxTime, times[k]);
 	}
 
-	if (NUM_ITERATIONS > 1) {
-		stdDev = sqrt(stdDev/(NUM_ITERATIONS - 1));
+	if (num_device_sorts > 1) {
+		stdDev = sqrt(stdDev/(num_device_sorts - 1));
 		std::cout << "Standard Deviation: " << stdDev * 1000 << std::endl;
 		std::cout << "%error (3*stdDev)/Average: " << 3*stdDev / AverageTime * 100 << "%" << std::endl;
 		std::cout << "min time: " << minTime * 1000 << " ms" << std::endl;
 		std::cout << "max time: " << maxTime * 1000 << " ms" << std::endl;
 	}
 
+#ifdef RUN_HETERO_SORTS
+	// the device and the host cores together: see HeteroSort
+	if (kernels_ready.get()) {
+		std::cout << "Sorting with HeteroSort on the " << pDeviceStr << " and the host with type " << type_name << std::endl;
+		hetero_sort_state hetero;
+		InitHeteroSortState(&hetero);
+		double heteroTime = 0.0;
+		uint hetero_failures = 0;
+		for(uint k = 0; k < NUM_ITERATIONS; k++) {
+			std::copy(original.begin(), original.end(), pArray);
+			beginClock = seconds();
+			HeteroSort(&myOCL, arraySize, pArray, pArrayCopy, &hetero);
+			endClock = seconds();
+			heteroTime += endClock - beginClock;
+#ifdef TRUST_BUT_VERIFY
+			std::vector<T> verify(original);
+			std::sort(verify.begin(), verify.end());
+			if (!std::equal(verify.begin(), verify.end(), pArray))
+				hetero_failures++;
+#endif
+		}
+		heteroTime = heteroTime/NUM_ITERATIONS;
+		std::cout << " Number of failures: " << hetero_failures << " out of " << NUM_ITERATIONS << std::endl;
+		std::cout << "Average Time: " << heteroTime * 1000 << " ms, last device share: " << hetero.gpu_share * 100 << "%" << std::endl;
+		std::cout << "Average speedup over GPUQSort alone: " << AverageTime/heteroTime << std::endl;
+	}
+#endif // RUN_HETERO_SORTS
+
 #ifdef RUN_CPU_SORTS
 	std::cout << "Average speedup over CPU quicksort: " << quickSortTime/AverageTime << std::endl;
 	std::cout << "Average speedup over CPU std::sort: " << stdSortTime/AverageTime << std::endl;
 #endif // RUN_CPU_SORTS
 
 	printf("-------done--------------------------------------------------------\n");
-#ifdef _MSC_VER
-	_aligned_free(pArray);
-	_aligned_free(pArrayCopy);
-#else // _MSC_VER
-  free(pArray);
-  free(pArrayCopy);
-#endif // _MSC_VER
-  return 0;
+	FreeArray(pArray);
+	FreeArray(pArrayCopy);
+	return 0;
 }
 
+// Many small independent sorts at once, the way a service sees them: CONCURRENT_REQUESTS arrays
+// of CONCURRENT_REQUEST_SIZE elements, sorted one after the other on the main queue, and then
+// from as many threads through a SorterPool of SORTER_POOL_QUEUES queues.
+#define SORTER_POOL_QUEUES 4
+#define CONCURRENT_REQUESTS 32
+#ifndef CONCURRENT_REQUEST_SIZE
+#define CONCURRENT_REQUEST_SIZE 100000
+#endif
+
+template <class T>
+int concurrent_test(OCLResources& myOCL, const std::string& type_name)
+{
+	double beginClock, endClock;
+
+	printf("\n\n\n--------------------------------------------------------------------\n");
+	std::cout << "Sorting " << CONCURRENT_REQUESTS << " arrays of " << CONCURRENT_REQUEST_SIZE << " elements of type " << type_name << std::endl;
+	std::vector<std::vector<T>> originals(CONCURRENT_REQUESTS), arrays, scratch(CONCURRENT_REQUESTS, std::vector<T>(CONCURRENT_REQUEST_SIZE));
+	for(auto& original : originals) {
+		original.resize(CONCURRENT_REQUEST_SIZE);
+		std::generate(original.begin(), original.end(), [](){static T i = 0; return ++i; });
+		std::random_shuffle(original.begin(), original.end());
+	}
+
+	arrays = originals;
+	beginClock = seconds();
+	for(uint k = 0; k < CONCURRENT_REQUESTS; k++)
+		GPUQSort(&myOCL, CONCURRENT_REQUEST_SIZE, arrays[k].data(), scratch[k].data());
+	endClock = seconds();
+	double sequentialTime = endClock - beginClock;
+	std::cout << "Time to sort one after the other: " << sequentialTime * 1000 << " ms" << std::endl;
+
+	arrays = originals;
+	SorterPool pool(&myOCL, SORTER_POOL_QUEUES);
+	std::vector<std::future<void>> requests;
+	beginClock = seconds();
+	for(uint k = 0; k < CONCURRENT_REQUESTS; k++)
+		requests.push_back(std::async(std::launch::async, [&pool, &arrays, &scratch, k]() {
+			pool.Sort(CONCURRENT_REQUEST_SIZE, arrays[k].data(), scratch[k].data());
+		}));
+	for(auto& request : requests)
+		request.get();
+	endClock = seconds();
+	double pooledTime = endClock - beginClock;
+	std::cout << "Time to sort concurrently on " << pool.size() << " queues: " << pooledTime * 1000 << " ms" << std::endl;
+	std::cout << "Speedup: " << sequentialTime/pooledTime << std::endl;
+
+	uint num_failures = 0;
+	for(uint k = 0; k < CONCURRENT_REQUESTS; k++) {
+		std::sort(originals[k].begin(), originals[k].end());
+		if (originals[k] != arrays[k])
+			num_failures++;
+	}
+	std::cout << " Number of failures: " << num_failures << " out of " << CONCURRENT_REQUESTS << std::endl;
+	printf("-------done--------------------------------------------------------\n");
+	return num_failures ? 1 : 0;
+}
+
+#if defined(USE_USM) && !defined(HALF_MEMORY)
+// The same arrays sorted in device memory with GPUQSortAsync: all the uploads and sorts are
+// submitted first, and every download only depends on the event of its sort.
+template <class T>
+int async_test(OCLResources& myOCL, const std::string& type_name)
+{
+	double beginClock, endClock;
+
+	printf("\n\n\n--------------------------------------------------------------------\n");
+	std::cout << "Sorting " << CONCURRENT_REQUESTS << " arrays of " << CONCURRENT_REQUEST_SIZE << " elements of type " << type_name << " with GPUQSortAsync" << std::endl;
+	std::vector<std::vector<T>> originals(CONCURRENT_REQUESTS), arrays(CONCURRENT_REQUESTS, std::vector<T>(CONCURRENT_REQUEST_SIZE));
+	for(auto& original : originals) {
+		original.resize(CONCURRENT_REQUEST_SIZE);
+		std::generate(original.begin(), original.end(), [](){static T i = 0; return ++i; });
+		std::random_shuffle(original.begin(), original.end());
+	}
+	std::vector<T*> d(CONCURRENT_REQUESTS), dn(CONCURRENT_REQUESTS);
+	for(uint k = 0; k < CONCURRENT_REQUESTS; k++) {
+		d[k] = malloc_device<T>(CONCURRENT_REQUEST_SIZE, myOCL.queue);
+		dn[k] = malloc_device<T>(CONCURRENT_REQUEST_SIZE, myOCL.queue);
+	}
+
+	beginClock = seconds();
+	std::vector<std::future<event>> sorts;
+	for(uint k = 0; k < CONCURRENT_REQUESTS; k++) {
+		event upload = myOCL.queue.memcpy(d[k], originals[k].data(), CONCURRENT_REQUEST_SIZE*sizeof(T));
+		sorts.push_back(GPUQSortAsync(&myOCL, CONCURRENT_REQUEST_SIZE, d[k], dn[k], std::vector<event>(1, upload)));
+	}
+	std::vector<event> downloads;
+	for(uint k = 0; k < CONCURRENT_REQUESTS; k++)
+		downloads.push_back(myOCL.queue.memcpy(arrays[k].data(), d[k], CONCURRENT_REQUEST_SIZE*sizeof(T), sorts[k].get()));
+	for(auto& download : downloads)
+		download.wait();
+	endClock = seconds();
+	std::cout << "Time to upload, sort and download asynchronously: " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+
+	uint num_failures = 0;
+	for(uint k = 0; k < CONCURRENT_REQUESTS; k++) {
+		std::sort(originals[k].begin(), originals[k].end());
+		if (originals[k] != arrays[k])
+			num_failures++;
+		cl::sycl::free(d[k], myOCL.queue);
+		cl::sycl::free(dn[k], myOCL.queue);
+	}
+	std::cout << " Number of failures: " << num_failures << " out of " << CONCURRENT_REQUESTS << std::endl;
+	printf("-------done--------------------------------------------------------\n");
+	return num_failures ? 1 : 0;
+}
+#endif // USE_USM && !HALF_MEMORY
+
 int main(int argc, char** argv)
 {
 	OCLResources	myOCL;
@@ -1188,10 +540,22 @@ int main(int argc, char** argv)
 	if (bShowCL)
 	    QueryPrintDeviceInfo(myOCL.queue);
 		
+	// Build the kernels for all types at once, in the background
+	std::shared_future<bool> uint_kernels = std::async(std::launch::async, BuildKernels<uint>, &myOCL, "uint").share();
+	std::shared_future<bool> float_kernels = std::async(std::launch::async, BuildKernels<float>, &myOCL, "float").share();
+	std::shared_future<bool> double_kernels = std::async(std::launch::async, BuildKernels<double>, &myOCL, "double").share();
+
 	uint arraySize = widthReSz*heightReSz;
-    big_test<uint>(myOCL,arraySize, NUM_ITERATIONS, pDeviceStr, "uint");
-    big_test<float>(myOCL,arraySize, NUM_ITERATIONS, pDeviceStr, "float");
-    big_test<double>(myOCL,arraySize, NUM_ITERATIONS, pDeviceStr, "double");
+    big_test<uint>(myOCL,arraySize, NUM_ITERATIONS, pDeviceStr, "uint", uint_kernels);
+    big_test<float>(myOCL,arraySize, NUM_ITERATIONS, pDeviceStr, "float", float_kernels);
+    big_test<double>(myOCL,arraySize, NUM_ITERATIONS, pDeviceStr, "double", double_kernels);
+
+	if (uint_kernels.get()) {
+		concurrent_test<uint>(myOCL, "uint");
+#if defined(USE_USM) && !defined(HALF_MEMORY)
+		async_test<uint>(myOCL, "uint");
+#endif
+	}
 
 	return 0;
 }
@@ -0,0 +1,336 @@
+/*
+Copyright (c) 2014-2019, Intel Corporation
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+* Redistributions of source code must retain the above copyright 
+      notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above 
+      copyright notice, this list of conditions and the following 
+      disclaimer in the documentation and/or other materials provided 
+      with the distribution.
+      * Neither the name of Intel Corporation nor the names of its 
+      contributors may be used to endorse or promote products 
+      derived from this software without specific prior written 
+      permission.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Transport.h : the communication layer of the distributed sample sort (DistributedSortMain.cpp).
+//
+// A Transport connects the P processes of a distributed sort. Only barrier, all_to_all and abort
+// need an implementation: ShmTransport runs the processes on one machine and passes the data
+// through POSIX shared memory. A transport over sockets or MPI plugs in the same way.
+//
+#ifndef TRANSPORT_DOT_H
+#define TRANSPORT_DOT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+class Transport
+{
+public:
+	virtual ~Transport() {}
+
+	virtual int rank() const = 0;
+	virtual int size() const = 0;
+	virtual bool barrier() = 0;
+	// Every rank sends send_bytes[r] bytes to rank r, which follow each other in send in rank
+	// order. recv receives what the ranks sent to this one, in rank order, recv_bytes[r] from rank r.
+	virtual bool all_to_all(const void* send, const std::vector<size_t>& send_bytes, 
+	                        std::vector<char>& recv, std::vector<size_t>& recv_bytes) = 0;
+	// Makes the pending and all the later collective operations of every rank fail, so that a
+	// rank which cannot go on does not leave the others waiting for it.
+	virtual void abort() = 0;
+
+	// Every rank sends the same bytes to all the ranks: out receives them in rank order.
+	bool all_gather(const void* in, size_t bytes, std::vector<char>& out) {
+		std::vector<char> send(bytes*size());
+		for(int r = 0; r < size(); r++)
+			memcpy(send.data() + r*bytes, in, bytes);
+		std::vector<size_t> send_bytes(size(), bytes), recv_bytes;
+		return all_to_all(send.data(), send_bytes, out, recv_bytes);
+	}
+};
+
+#ifndef _MSC_VER
+// How often a rank waiting on the barrier looks at the abort flag, in case it missed the wake up
+#ifndef SHM_BARRIER_POLL_MS
+#define SHM_BARRIER_POLL_MS 100
+#endif
+
+// The control segment holds a process shared barrier and the byte counts of the current
+// all_to_all. The data of an all_to_all goes through one segment per sending rank, which the
+// sender creates and fills, and the receivers copy their part from.
+//
+// The barrier is a robust mutex and a condition rather than a pthread_barrier_t, which cannot be
+// left: once aborted is set every wait on it fails, whether it has begun or not.
+struct shm_control {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int waiting;              // ranks on the barrier
+	unsigned int generation;  // barriers completed
+	int aborted;
+	int num_ranks;
+	unsigned long long counts[1]; // num_ranks*num_ranks: counts[s*num_ranks + r] bytes from s to r
+};
+
+class ShmTransport : public Transport
+{
+public:
+	ShmTransport() : pControl(NULL), controlSize(0), myRank(0) {}
+	~ShmTransport() { Detach(); }
+
+	// Creates the control segment of num_ranks processes: call it once, before any of them attaches
+	static bool Create(const std::string& name, int num_ranks) {
+		size_t bytes = ControlSize(num_ranks);
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0) {
+			perror("shm_open");
+			return false;
+		}
+		if (ftruncate(fd, bytes) != 0) {
+			perror("ftruncate");
+			close(fd);
+			shm_unlink(name.c_str());
+			return false;
+		}
+		shm_control* pControl = (shm_control*)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (pControl == MAP_FAILED) {
+			perror("mmap");
+			shm_unlink(name.c_str());
+			return false;
+		}
+		pthread_mutexattr_t mutex_attr;
+		pthread_mutexattr_init(&mutex_attr);
+		pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+		// a rank which dies holding the mutex does not lock the others out
+		pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&pControl->mutex, &mutex_attr);
+		pthread_mutexattr_destroy(&mutex_attr);
+		pthread_condattr_t cond_attr;
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&pControl->cond, &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
+		pControl->waiting = 0;
+		pControl->generation = 0;
+		pControl->aborted = 0;
+		pControl->num_ranks = num_ranks;
+		munmap(pControl, bytes);
+		return true;
+	}
+
+	// Removes the control segment, and the data segments that ranks which failed in an all_to_all
+	// left behind, once all the processes are done with them
+	static void Remove(const std::string& name, int num_ranks) {
+		shm_unlink(name.c_str());
+		for(int r = 0; r < num_ranks; r++)
+			shm_unlink(DataSegmentName(name, r).c_str());
+	}
+
+	bool Attach(const std::string& name, int rank) {
+		int fd = shm_open(name.c_str(), O_RDWR, 0600);
+		if (fd < 0) {
+			perror("shm_open");
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			perror("fstat");
+			close(fd);
+			return false;
+		}
+		controlSize = st.st_size;
+		pControl = (shm_control*)mmap(NULL, controlSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (pControl == MAP_FAILED) {
+			perror("mmap");
+			pControl = NULL;
+			return false;
+		}
+		segmentName = name;
+		myRank = rank;
+		return true;
+	}
+
+	void Detach() {
+		if (pControl != NULL) {
+			munmap(pControl, controlSize);
+			pControl = NULL;
+		}
+	}
+
+	int rank() const { return myRank; }
+	int size() const { return pControl->num_ranks; }
+
+	bool barrier() {
+		if (!Lock())
+			return false;
+		unsigned int generation = pControl->generation;
+		if (!pControl->aborted && ++pControl->waiting == pControl->num_ranks) {
+			pControl->waiting = 0;
+			pControl->generation++;
+			pthread_cond_broadcast(&pControl->cond);
+		}
+		while (pControl->generation == generation && !pControl->aborted) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_nsec += SHM_BARRIER_POLL_MS * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			if (pthread_cond_timedwait(&pControl->cond, &pControl->mutex, &deadline) == EOWNERDEAD)
+				pthread_mutex_consistent(&pControl->mutex);
+		}
+		bool passed = pControl->generation != generation;
+		pthread_mutex_unlock(&pControl->mutex);
+		return passed;
+	}
+
+	void abort() {
+		if (pControl == NULL || !Lock())
+			return;
+		pControl->aborted = 1;
+		pthread_cond_broadcast(&pControl->cond);
+		pthread_mutex_unlock(&pControl->mutex);
+	}
+
+	bool all_to_all(const void* send, const std::vector<size_t>& send_bytes, 
+	                std::vector<char>& recv, std::vector<size_t>& recv_bytes) {
+		const int P = size();
+		unsigned long long* counts = pControl->counts;
+		size_t total = 0;
+		for(int r = 0; r < P; r++) {
+			counts[myRank*P + r] = send_bytes[r];
+			total += send_bytes[r];
+		}
+
+		// publish the outgoing data
+		std::string myName = DataSegmentName(myRank);
+		int fd = shm_open(myName.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+		if (fd < 0) {
+			perror("shm_open");
+			return false;
+		}
+		// a segment is at least one byte long, so that it can be mapped
+		if (ftruncate(fd, std::max(total, (size_t)1)) != 0) {
+			perror("ftruncate");
+			close(fd);
+			shm_unlink(myName.c_str());
+			return false;
+		}
+		char* pData = (char*)mmap(NULL, std::max(total, (size_t)1), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (pData == MAP_FAILED) {
+			perror("mmap");
+			shm_unlink(myName.c_str());
+			return false;
+		}
+		memcpy(pData, send, total);
+		if (!barrier()) {
+			munmap(pData, std::max(total, (size_t)1));
+			shm_unlink(myName.c_str());
+			return false;
+		}
+
+		// copy this rank's part of every segment
+		bool ok = true;
+		recv_bytes.resize(P);
+		size_t recv_total = 0;
+		for(int s = 0; s < P; s++) {
+			recv_bytes[s] = counts[s*P + myRank];
+			recv_total += recv_bytes[s];
+		}
+		recv.resize(recv_total);
+		size_t pos = 0;
+		for(int s = 0; s < P; s++) {
+			size_t offset = 0, segment = 0;
+			for(int r = 0; r < P; r++) {
+				if (r < myRank)
+					offset += counts[s*P + r];
+				segment += counts[s*P + r];
+			}
+			if (s == myRank) {
+				memcpy(recv.data() + pos, pData + offset, recv_bytes[s]);
+			} else if (recv_bytes[s] > 0) {
+				int sfd = shm_open(DataSegmentName(s).c_str(), O_RDONLY, 0600);
+				char* pSource = sfd < 0 ? (char*)MAP_FAILED : 
+				                (char*)mmap(NULL, segment, PROT_READ, MAP_SHARED, sfd, 0);
+				if (sfd >= 0)
+					close(sfd);
+				if (pSource == MAP_FAILED) {
+					perror("shm_open/mmap");
+					ok = false;
+				} else {
+					memcpy(recv.data() + pos, pSource + offset, recv_bytes[s]);
+					munmap(pSource, segment);
+				}
+			}
+			pos += recv_bytes[s];
+		}
+
+		// the segment goes away when all the ranks have their part
+		if (!barrier())
+			ok = false;
+		munmap(pData, std::max(total, (size_t)1));
+		shm_unlink(myName.c_str());
+		return ok;
+	}
+
+private:
+	static size_t ControlSize(int num_ranks) {
+		return sizeof(shm_control) + (num_ranks*num_ranks - 1)*sizeof(unsigned long long);
+	}
+
+	static std::string DataSegmentName(const std::string& name, int rank) {
+		return name + "." + std::to_string(rank);
+	}
+
+	std::string DataSegmentName(int rank) const {
+		return DataSegmentName(segmentName, rank);
+	}
+
+	bool Lock() {
+		int ret = pthread_mutex_lock(&pControl->mutex);
+		// the rank which held it died: the barrier state it protects is still whole
+		if (ret == EOWNERDEAD)
+			ret = pthread_mutex_consistent(&pControl->mutex);
+		return ret == 0;
+	}
+
+	shm_control* pControl;
+	size_t controlSize;
+	std::string segmentName;
+	int myRank;
+};
+#endif // _MSC_VER
+
+#endif // TRANSPORT_DOT_H
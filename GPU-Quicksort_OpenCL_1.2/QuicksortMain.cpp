@@ -45,13 +45,20 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 #include "OpenCLUtils.h"
 #include <math.h>
+#include <limits.h>
 #include <iostream>
 #include <algorithm>
 #include <iterator>
 #include <vector>
 #include <map>
+#include <functional>
+#include <utility>
 
 #include "tbb/parallel_sort.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/parallel_scan.h"
+#include "tbb/blocked_range.h"
 // Types:
 typedef unsigned int uint;
 #ifdef min
@@ -150,6 +157,34 @@ void InstantiateOpenCLKernels(OCLResources *pOCL)
 #define HOST 1
 #include "Quicksort.h"
 
+// Device record buffers that the gqsort passes and lqsort of a sort reuse: a buffer is only
+// replaced, by one twice as large as needed, when a pass needs more bytes than it holds.
+// The records are written and read explicitly, so no buffer is created or released per pass.
+typedef struct record_buffer {
+	cl_mem mem;
+	size_t capacity;
+	record_buffer() : mem(NULL), capacity(0) {}
+	~record_buffer() { 
+		if (mem != NULL) 
+			clReleaseMemObject(mem); 
+	}
+} record_buffer;
+
+typedef struct record_buffers {
+	record_buffer blocks, parents, news, done;
+} record_buffers;
+
+cl_mem ReserveRecordBuffer(OCLResources *pOCL, record_buffer* pBuffer, size_t bytes) {
+	if (pBuffer->mem == NULL || bytes > pBuffer->capacity) {
+		if (pBuffer->mem != NULL)
+			clReleaseMemObject(pBuffer->mem);
+		pBuffer->capacity = std::max(std::max(bytes, 2*pBuffer->capacity), (size_t)64);
+		pBuffer->mem = clCreateBuffer(pOCL->contextHdl, CL_MEM_READ_WRITE, pBuffer->capacity, NULL, &ciErrNum);
+		CheckCLError (ciErrNum, "clCreateBuffer failed.", "clCreateBuffer.");
+	}
+	return pBuffer->mem;
+}
+
 
 template <class T>
 T* partition(T* left, T* right, T pivot) {
@@ -200,19 +235,23 @@ void quicksort(T* data, int left, int right)
 }
 
 template <class T>
-void gqsort(OCLResources *pOCL, std::vector<block_record>& blocks, std::vector<parent_record>& parents, std::vector<work_record>& news, bool reset) {
+void gqsort(OCLResources *pOCL, std::vector<block_record>& blocks, std::vector<parent_record>& parents, std::vector<work_record>& news, record_buffers* pRecords, bool reset) {
 	news.resize(blocks.size()*2);
 
 	size_t		dimNDR[2] = { 0, 0};
 	size_t		dimWG[2] = { 0, 0 };
 
-	// Create buffer objects for memory.
-	cl_mem blocksb = clCreateBuffer(pOCL->contextHdl, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sizeof(block_record)*blocks.size(), &blocks[0], &ciErrNum);
-	CheckCLError (ciErrNum, "clCreateBuffer failed.", "clCreateBuffer.");
-	cl_mem parentsb = clCreateBuffer(pOCL->contextHdl, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sizeof(parent_record)*parents.size(), &parents[0], &ciErrNum);
-	CheckCLError (ciErrNum, "clCreateBuffer failed.", "clCreateBuffer.");
-	cl_mem newsb = clCreateBuffer(pOCL->contextHdl, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sizeof(work_record)*news.size(), &news[0], &ciErrNum);
-	CheckCLError (ciErrNum, "clCreateBuffer failed.", "clCreateBuffer.");
+	// Copy the records into the record buffers of the sort.
+	cl_mem blocksb = ReserveRecordBuffer(pOCL, &pRecords->blocks, sizeof(block_record)*blocks.size());
+	ciErrNum = clEnqueueWriteBuffer(pOCL->cmdQHdl, blocksb, CL_FALSE, 0, sizeof(block_record)*blocks.size(), &blocks[0], 0, NULL, NULL);
+	CheckCLError(ciErrNum, "clEnqueueWriteBuffer failed.", "clEnqueueWriteBuffer");
+	cl_mem parentsb = ReserveRecordBuffer(pOCL, &pRecords->parents, sizeof(parent_record)*parents.size());
+	ciErrNum = clEnqueueWriteBuffer(pOCL->cmdQHdl, parentsb, CL_FALSE, 0, sizeof(parent_record)*parents.size(), &parents[0], 0, NULL, NULL);
+	CheckCLError(ciErrNum, "clEnqueueWriteBuffer failed.", "clEnqueueWriteBuffer");
+	// news is all empty records: the kernel only writes the records of the parents it is done with
+	cl_mem newsb = ReserveRecordBuffer(pOCL, &pRecords->news, sizeof(work_record)*news.size());
+	ciErrNum = clEnqueueWriteBuffer(pOCL->cmdQHdl, newsb, CL_FALSE, 0, sizeof(work_record)*news.size(), &news[0], 0, NULL, NULL);
+	CheckCLError(ciErrNum, "clEnqueueWriteBuffer failed.", "clEnqueueWriteBuffer");
 	
 
 	ciErrNum |= clSetKernelArg(gqsort_kernel, 2, sizeof(cl_mem), (void*) &blocksb);
@@ -250,19 +289,17 @@ void gqsort(OCLResources *pOCL, std::vector<block_record>& blocks, std::vector<p
 	absoluteTotal += totalTime;
 	std::cout << ++count << ": gqsort time " << absoluteTotal * 1000 << " ms" << std::endl;
 #endif
-	clReleaseMemObject(blocksb);
-	clReleaseMemObject(parentsb);
-	clReleaseMemObject(newsb);
 }
 
 template <class T>
-void lqsort(OCLResources *pOCL, std::vector<work_record>& done, cl_mem tempb) {
+void lqsort(OCLResources *pOCL, std::vector<work_record>& done, record_buffers* pRecords) {
 	size_t		dimNDR[2] = { 0, 0};
 	size_t		dimWG[2] = { 0, 0 };
 
 	//std::cout << "done size is " << done.size() << std::endl; 
-	cl_mem doneb = clCreateBuffer(pOCL->contextHdl, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, sizeof(work_record)*done.size(), &done[0], &ciErrNum);
-	CheckCLError (ciErrNum, "clCreateBuffer failed.", "clCreateBuffer.");
+	cl_mem doneb = ReserveRecordBuffer(pOCL, &pRecords->done, sizeof(work_record)*done.size());
+	ciErrNum = clEnqueueWriteBuffer(pOCL->cmdQHdl, doneb, CL_FALSE, 0, sizeof(work_record)*done.size(), &done[0], 0, NULL, NULL);
+	CheckCLError(ciErrNum, "clEnqueueWriteBuffer failed.", "clEnqueueWriteBuffer");
 	
 	ciErrNum |= clSetKernelArg(lqsort_kernel, 2, sizeof(cl_mem), (void*) &doneb);
 	CheckCLError(ciErrNum, "clSetKernelArg failed.", "clSetKernelArg");
@@ -287,13 +324,84 @@ void lqsort(OCLResources *pOCL, std::vector<work_record>& done, cl_mem tempb) {
 	double totalTime = endClock - beginClock;
 	std::cout << "lqsort time " << totalTime * 1000 << " ms" << std::endl;
 #endif
-	clReleaseMemObject(doneb);
 }
 
 size_t optp(size_t s, double k, size_t m) {
 	return (size_t)pow(2, floor(log(s*k + m)/log(2.0) + 0.5));
 }
 
+// Builds the parent and block records of a gqsort pass from the work records. Every work record
+// is cut into blocks of blocksize elements: a parallel prefix sum over the block counts of the
+// work records gives each of them the place of its blocks, so they are all built in parallel.
+template <class W, class P, class B>
+void make_block_records(const W& work, size_t MAXSEQ, P& parent_records, B& blocks) {
+	typedef typename P::value_type parent_type;
+	typedef typename B::value_type block_type;
+	const size_t blocksize = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, work.size()), (size_t)0, 
+		[&](const tbb::blocked_range<size_t>& r, size_t sum) {
+			for(size_t i = r.begin(); i != r.end(); ++i)
+				sum += std::max((work[i].end - work[i].start)/MAXSEQ, (size_t)1);
+			return sum;
+		}, std::plus<size_t>());
+	// first[i] is the index of the first block of work[i]
+	std::vector<size_t> first(work.size() + 1);
+	first[work.size()] = tbb::parallel_scan(tbb::blocked_range<size_t>(0, work.size()), (size_t)0, 
+		[&](const tbb::blocked_range<size_t>& r, size_t sum, bool is_final_scan) {
+			for(size_t i = r.begin(); i != r.end(); ++i) {
+				if (is_final_scan)
+					first[i] = sum;
+				sum += (work[i].end - work[i].start + blocksize - 1)/blocksize;
+			}
+			return sum;
+		}, std::plus<size_t>());
+	parent_records.resize(work.size());
+	blocks.resize(first[work.size()]);
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, work.size()), [&](const tbb::blocked_range<size_t>& r) {
+		for(size_t w = r.begin(); w != r.end(); ++w) {
+			uint start = work[w].start;
+			uint end   = work[w].end;
+			uint direction = work[w].direction;
+			uint blockcount = (uint)(first[w+1] - first[w]);
+			parent_records[w] = parent_type(start, end, start, end, blockcount-1);
+
+			for(uint i = 0; i < blockcount - 1; i++) {
+				uint bstart = start + blocksize*i;
+				blocks[first[w] + i] = block_type(bstart, bstart+blocksize, work[w].pivot, direction, (uint)w);
+			}
+			blocks[first[w] + blockcount - 1] = block_type(start + blocksize*(blockcount - 1), end, work[w].pivot, direction, (uint)w);
+		}
+	});
+}
+
+// Sorts the new records of a gqsort pass into work, the ones still too long for lqsort, and done.
+// A parallel prefix sum over both counts gives every record its place, so the order is kept.
+template <class N, class W, class D>
+void split_new_records(const N& news, W& work, D& done) {
+	typedef std::pair<size_t, size_t> counts; // work records, done records
+	const size_t done_size = done.size();
+	work.resize(news.size());
+	done.resize(done_size + news.size());
+	counts total = tbb::parallel_scan(tbb::blocked_range<size_t>(0, news.size()), counts(0, 0), 
+		[&](const tbb::blocked_range<size_t>& r, counts sum, bool is_final_scan) {
+			for(size_t i = r.begin(); i != r.end(); ++i) {
+				if (news[i].direction == EMPTY_RECORD || news[i].end == news[i].start)
+					continue;
+				if (news[i].end - news[i].start <= QUICKSORT_BLOCK_SIZE /*size/MAXSEQ*/) {
+					if (is_final_scan)
+						done[done_size + sum.second] = news[i];
+					sum.second++;
+				} else {
+					if (is_final_scan)
+						work[sum.first] = news[i];
+					sum.first++;
+				}
+			}
+			return sum;
+		}, [](const counts& a, const counts& b) { return counts(a.first + b.first, a.second + b.second); });
+	work.resize(total.first);
+	done.resize(done_size + total.second);
+}
+
 template <class T>
 void GPUQSort(OCLResources *pOCL, size_t size, T* d, T* dn)  {
 	// allocate buffers
@@ -324,51 +432,22 @@ void GPUQSort(OCLResources *pOCL, size_t size, T* d, T* dn)  {
 	parent_records.reserve(MAX_SIZE);
 	std::vector<block_record> blocks;
 	blocks.reserve(MAX_SIZE);
+	// device copies of the records, reused by all the passes
+	record_buffers records;
 	
 	work.push_back(work_record(0, size, startpivot, 1));
 
 	bool reset = true;
 
 	while(!work.empty() /*&& work.size() + done.size() < MAXSEQ*/) {
-		size_t blocksize = 0;
-		
-		for(auto it = work.begin(); it != work.end(); ++it) {
-			blocksize += std::max((it->end - it->start)/MAXSEQ, (size_t)1);
-		}
-		for(auto it = work.begin(); it != work.end(); ++it) {
-			uint start = it->start;
-			uint end   = it->end;
-			uint pivot = it->pivot;
-			uint direction = it->direction;
-			uint blockcount = (end - start + blocksize - 1)/blocksize;
-			parent_record prnt(start, end, start, end, blockcount-1);
-			parent_records.push_back(prnt);
-
-			for(uint i = 0; i < blockcount - 1; i++) {
-				uint bstart = start + blocksize*i;
-				block_record br(bstart, bstart+blocksize, pivot, direction, parent_records.size()-1);
-				blocks.push_back(br);
-			}
-			block_record br(start + blocksize*(blockcount - 1), end, pivot, direction, parent_records.size()-1);
-			blocks.push_back(br);
-		}
+		make_block_records(work, MAXSEQ, parent_records, blocks);
 
-		gqsort<T>(pOCL, blocks, parent_records, news, reset);
+		gqsort<T>(pOCL, blocks, parent_records, news, &records, reset);
 		reset = false;
 		//std::cout << " blocks = " << blocks.size() << " parent records = " << parent_records.size() << " news = " << news.size() << std::endl;
-		work.clear();
 		parent_records.clear();
 		blocks.clear();
-		for(auto it = news.begin(); it != news.end(); ++it) {
-			if (it->direction != EMPTY_RECORD) {
-				if (it->end - it->start <= QUICKSORT_BLOCK_SIZE /*size/MAXSEQ*/) {
-					if (it->end - it->start > 0)
-						done.push_back(*it);
-				} else {
-					work.push_back(*it);
-				}
-			}
-		}
+		split_new_records(news, work, done);
 		news.clear();
 	}
 	for(auto it = work.begin(); it != work.end(); ++it) {
@@ -376,13 +455,111 @@ void GPUQSort(OCLResources *pOCL, size_t size, T* d, T* dn)  {
 			done.push_back(*it);
 	}
 
-	lqsort<T>(pOCL, done, db);
+	lqsort<T>(pOCL, done, &records);
 
 	// release buffers: we are done
 	clReleaseMemObject(db);
 	clReleaseMemObject(dnb);
 }
 
+#ifdef QUICKSORT_FILE
+// quicksort-file: sorts a raw binary file in place. The file is memory mapped and the mapping
+// becomes the d buffer of GPUQSort (CL_MEM_USE_HOST_PTR), so on CPU devices the data is never
+// read into a temporary array nor written back from one.
+int main(int argc, char** argv)
+{
+	OCLResources	myOCL;
+	char			pDeviceStr[256] = "gpu";
+	char			pVendorStr[256] = "intel";
+	const char*		pSourceFileStr	= "QuicksortKernels.cl";
+	const char sUsageString[512] = "Usage: quicksort-file <file> <uint> [cpu|gpu] [intel|amd|nvidia]\n       quicksort-file --generate <num elements> <file> <uint>";
+
+	double totalTime;
+
+	double beginClock, endClock;
+
+	if (argc == 5 && std::string(argv[1]) == "--generate") {
+		// random input to try it out
+		size_t size = strtoull(argv[2], NULL, 10);
+		FILE* fp = fopen(argv[3], "wb");
+		if (!fp || std::string(argv[4]) != "uint")
+			Cleanup (&myOCL, -1, true, sUsageString);
+		std::vector<uint> buf(1 << 20);
+		srand((unsigned)size);
+		for(size_t i = 0; i < size; i += buf.size()) {
+			size_t n = std::min(buf.size(), size - i);
+			std::generate(buf.begin(), buf.begin() + n, [](){ return (uint)rand() << 16 ^ (uint)rand(); });
+			fwrite(&buf[0], sizeof(uint), n, fp);
+		}
+		fclose(fp);
+		return 0;
+	}
+	if (argc < 3 || argc > 5)
+		Cleanup (&myOCL, -1, true, sUsageString);
+	// the kernels in QuicksortKernels.cl are written for uint only
+	if (std::string(argv[2]) != "uint")
+		Cleanup (&myOCL, -1, true, "quicksort-file: this sample sorts uint files only");
+	if (argc > 3)
+		sprintf (pDeviceStr, "%s", argv[3]);
+	if (argc > 4)
+		sprintf (pVendorStr, "%s", argv[4]);
+
+	MappedFile file;
+	if (!MapFile(argv[1], &file))
+		Cleanup (&myOCL, -1, true, "quicksort-file: failed to map the file");
+	uint* pArray = (uint*)file.pData;
+	size_t arraySize = file.fileSize/sizeof(uint);
+	// GPUQSort indexes with uint
+	if (file.fileSize/sizeof(uint) > UINT_MAX) {
+		UnmapFile(&file);
+		Cleanup (&myOCL, -1, true, "quicksort-file: the file has more than UINT_MAX elements");
+	}
+	printf("Sorting %s: %llu elements\n", argv[1], (unsigned long long)arraySize);
+
+	// Initialize OpenCL:
+	bool bCPUDevice;
+	InitializeOpenCL (pDeviceStr, pVendorStr, &myOCL.deviceID, &myOCL.contextHdl, &myOCL.cmdQHdl, bCPUDevice);
+  beginClock = seconds();
+	CompileOpenCLProgram (bCPUDevice, myOCL.deviceID, myOCL.contextHdl, pSourceFileStr, &myOCL.programHdl);
+  endClock = seconds();
+	totalTime = endClock - beginClock;
+	std::cout << "Time to build OpenCL Program: " << totalTime * 1000 << " ms" << std::endl;
+	InstantiateOpenCLKernels (&myOCL);
+
+	if (arraySize > 1) {
+#ifdef _MSC_VER 
+		uint* pArrayCopy = (uint*)_aligned_malloc (((arraySize*sizeof(uint))/64 + 1)*64, 4096);
+#else // _MSC_VER
+		uint* pArrayCopy = (uint*)aligned_alloc (4096, ((arraySize*sizeof(uint))/64 + 1)*64);
+#endif // _MSC_VER
+		beginClock = seconds();
+		GPUQSort(&myOCL, arraySize, pArray, pArrayCopy);
+		endClock = seconds();
+		totalTime = endClock - beginClock;
+		std::cout << "Time to sort: " << totalTime * 1000 << " ms" << std::endl;
+#ifdef _MSC_VER
+		_aligned_free(pArrayCopy);
+#else // _MSC_VER
+		free(pArrayCopy);
+#endif // _MSC_VER
+	}
+#ifdef TRUST_BUT_VERIFY
+	bool correct = std::is_sorted(pArray, pArray + arraySize);
+	std::cout << "verifying: " << std::boolalpha << correct << std::endl;
+#else
+	bool correct = true;
+#endif
+
+	beginClock = seconds();
+	if (!UnmapFile(&file))
+		Cleanup (&myOCL, -1, true, "quicksort-file: failed to write the file back");
+	endClock = seconds();
+	std::cout << "Time to unmap: " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+
+	printf("-------done--------------------------------------------------------\n");
+	return correct ? 0 : 1;
+}
+#else // QUICKSORT_FILE
 int main(int argc, char** argv)
 {
 	OCLResources	myOCL;
@@ -550,3 +727,4 @@ int main(int argc, char** argv)
 
 	return 0;
 }
+#endif // QUICKSORT_FILE
@@ -34,6 +34,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <CL/cl.h>
 #include <string>
+#include <string.h>
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 
 // Util for error checking:
@@ -259,20 +265,185 @@ void CreateOCLProgramFromSourceFile(char const *pSrcFilePath, cl_context hClCont
         free(buf);
 }
 
+// Util for caching built OpenCL programs on disk:
+// clBuildProgram from source dominates the run time of short-lived processes, so once a program
+// is built its device binary is stored under a key made of the kernel sources, the build options,
+// the device and the driver version. Later runs reload it with clCreateProgramWithBinary.
+// Set QUICKSORT_CL_CACHE_DIR to choose the cache directory (the current directory by default),
+// or comment out the define below to always build from source.
+#define USE_PROGRAM_BINARY_CACHE 1
+
+// 64-bit FNV-1a hash of a file's contents; the file is allowed to be missing
+unsigned long long HashFile(const char* pFilePath, unsigned long long hash)
+{
+	FILE* fp = fopen(pFilePath, "rb");
+	if (!fp)
+		return hash;
+
+	unsigned char buf[4096];
+	size_t bytes_read;
+	while ((bytes_read = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		for (size_t i = 0; i < bytes_read; i++) {
+			hash ^= buf[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+	fclose(fp);
+	return hash;
+}
+
+unsigned long long HashString(const char* pStr, unsigned long long hash)
+{
+	for (; *pStr; pStr++) {
+		hash ^= (unsigned char)*pStr;
+		hash *= 1099511628211ULL;
+	}
+	// terminate every field so that "ab" + "c" and "a" + "bc" hash differently
+	hash ^= 0xff;
+	hash *= 1099511628211ULL;
+	return hash;
+}
+
+std::string ProgramCacheFileName(cl_device_id oclDeviceID, const char* pSourceFileStr, const char* pBuildOptions)
+{
+	char pDeviceNameString[512];
+	char pDriverVersionString[512];
+	cl_int ciErrNum = clGetDeviceInfo(oclDeviceID, CL_DEVICE_NAME, sizeof(pDeviceNameString), pDeviceNameString, NULL);
+	if (ciErrNum != CL_SUCCESS)
+		pDeviceNameString[0] = '\0';
+	ciErrNum = clGetDeviceInfo(oclDeviceID, CL_DRIVER_VERSION, sizeof(pDriverVersionString), pDriverVersionString, NULL);
+	if (ciErrNum != CL_SUCCESS)
+		pDriverVersionString[0] = '\0';
+
+	// The kernel source includes Quicksort.h, which holds the block and work group sizes
+	unsigned long long hash = 14695981039346656037ULL;
+	hash = HashFile(pSourceFileStr, hash);
+	hash = HashFile("Quicksort.h", hash);
+	hash = HashString(pBuildOptions, hash);
+	hash = HashString(pDeviceNameString, hash);
+	hash = HashString(pDriverVersionString, hash);
+
+	const char* pCacheDir = getenv("QUICKSORT_CL_CACHE_DIR");
+	if (!pCacheDir || !*pCacheDir)
+		pCacheDir = ".";
+
+	char pFileName[64];
+	sprintf(pFileName, "/QuicksortKernels-%016llx.clbin", hash);
+	return std::string(pCacheDir) + pFileName;
+}
+
+bool LoadCachedProgram(const std::string& cacheFile, cl_device_id oclDeviceID, cl_context oclContextHdl, const char* pBuildOptions, cl_program* pOclProgramHdl)
+{
+	FILE* fp = fopen(cacheFile.c_str(), "rb");
+	if (!fp)
+		return false;
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (size <= 0) {
+		fclose(fp);
+		return false;
+	}
+
+	unsigned char* buf = (unsigned char*)malloc(size);
+	if (buf == 0) {
+		fclose(fp);
+		return false;
+	}
+	size_t records_read = fread(buf, size, 1, fp);
+	fclose(fp);
+	if (records_read != 1) {
+		free(buf);
+		return false;
+	}
+
+	size_t szBinaryLength = size;
+	cl_int binaryStatus;
+	cl_int ciErrNum;
+	cl_program oclProgramHdl = clCreateProgramWithBinary(oclContextHdl, 1, &oclDeviceID, &szBinaryLength, (const unsigned char **) &buf, &binaryStatus, &ciErrNum);
+	free(buf);
+	if (ciErrNum != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+		if (oclProgramHdl)
+			clReleaseProgram(oclProgramHdl);
+		return false;
+	}
+
+	// Binaries still have to be built, but this does not involve the compiler front end
+	ciErrNum = clBuildProgram(oclProgramHdl, 1, &oclDeviceID, pBuildOptions, NULL, NULL);
+	if (ciErrNum != CL_SUCCESS) {
+		clReleaseProgram(oclProgramHdl);
+		return false;
+	}
+
+	*pOclProgramHdl = oclProgramHdl;
+	return true;
+}
+
+void SaveProgramBinary(const std::string& cacheFile, cl_program oclProgramHdl)
+{
+	// The program is built for exactly one device
+	size_t szBinaryLength = 0;
+	cl_int ciErrNum = clGetProgramInfo(oclProgramHdl, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &szBinaryLength, NULL);
+	if (ciErrNum != CL_SUCCESS || szBinaryLength == 0)
+		return;
+
+	unsigned char* buf = (unsigned char*)malloc(szBinaryLength);
+	if (buf == 0)
+		return;
+	ciErrNum = clGetProgramInfo(oclProgramHdl, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &buf, NULL);
+	if (ciErrNum != CL_SUCCESS) {
+		free(buf);
+		return;
+	}
+
+	// Write to a temporary file first: concurrent workers must never see a partially written binary
+	char pSuffix[32];
+#ifdef _MSC_VER
+	sprintf(pSuffix, ".%u.tmp", (unsigned)GetCurrentProcessId());
+#else
+	sprintf(pSuffix, ".%u.tmp", (unsigned)getpid());
+#endif
+	std::string tmpFile = cacheFile + pSuffix;
+	FILE* fp = fopen(tmpFile.c_str(), "wb");
+	if (!fp) {
+		printf("Failed to write the OpenCL program binary cache: %s\n", tmpFile.c_str());
+		free(buf);
+		return;
+	}
+	size_t records_written = fwrite(buf, szBinaryLength, 1, fp);
+	int err = fclose(fp);
+	free(buf);
+	if (records_written != 1 || err != 0 || rename(tmpFile.c_str(), cacheFile.c_str()) != 0)
+		remove(tmpFile.c_str());
+}
+
 void CompileOpenCLProgram(bool bCPUDevice, cl_device_id oclDeviceID, cl_context oclContextHdl, const char* pSourceFileStr, cl_program* pOclProgramHdl)
 {
 	cl_int		ciErrNum;
 	cl_program	oclProgramHdl;
+	const char*	pBuildOptions;
 
 	*pOclProgramHdl = NULL;
 
-	CreateOCLProgramFromSourceFile(pSourceFileStr, oclContextHdl, &oclProgramHdl);
-
 	if (bCPUDevice) {
-		ciErrNum = clBuildProgram(oclProgramHdl, 0, NULL, "-cl-std=CL2.0 -cl-mad-enable -DCPU_DEVICE=1", NULL, NULL);
+		pBuildOptions = "-cl-std=CL2.0 -cl-mad-enable -DCPU_DEVICE=1";
 	} else {
-		ciErrNum = clBuildProgram(oclProgramHdl, 0, NULL, "-cl-std=CL2.0 -cl-mad-enable", NULL, NULL);
+		pBuildOptions = "-cl-std=CL2.0 -cl-mad-enable";
 	}
+
+#ifdef USE_PROGRAM_BINARY_CACHE
+	std::string cacheFile = ProgramCacheFileName(oclDeviceID, pSourceFileStr, pBuildOptions);
+	if (LoadCachedProgram(cacheFile, oclDeviceID, oclContextHdl, pBuildOptions, &oclProgramHdl)) {
+		printf("Loaded OpenCL program binary: %s\n", cacheFile.c_str());
+		*pOclProgramHdl = oclProgramHdl;
+		return;
+	}
+#endif
+
+	CreateOCLProgramFromSourceFile(pSourceFileStr, oclContextHdl, &oclProgramHdl);
+
+	ciErrNum = clBuildProgram(oclProgramHdl, 0, NULL, pBuildOptions, NULL, NULL);
 	if (ciErrNum != CL_SUCCESS)
 	{
 		printf("ERROR: Failed to build program... ciErrNum = %d\n", ciErrNum);
@@ -286,6 +457,10 @@ void CompileOpenCLProgram(bool bCPUDevice, cl_device_id oclDeviceID, cl_context
 		exit(0);
 	}
 
+#ifdef USE_PROGRAM_BINARY_CACHE
+	SaveProgramBinary(cacheFile, oclProgramHdl);
+#endif
+
 	// Output parameters:
 	*pOclProgramHdl = oclProgramHdl;
 }
@@ -389,4 +564,7 @@ void QueryPrintOpenCLDeviceInfo(cl_device_id deviceID, cl_context contextHdl)
 	CheckCLError (ciErrNum, "clGetSupportedImageFormats() query failed.", "clGetSupportedImageFormats() query success");
 }
 
+// Util for sorting files in place through a memory mapping:
+#include "../GPU-Quicksort_Common/MappedFile.h"
+
 #endif
@@ -45,6 +45,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 #include "OpenCLUtils.h"
 #include <math.h>
+#include <limits.h>
 #include <iostream>
 #include <algorithm>
 #include <iterator>
@@ -329,6 +330,114 @@ void GPUQSort(OCLResources *pOCL, size_t size, T* d, work_record* pdone, work_re
 	CheckCLError(ciErrNum, "clEnqueueUnmapMemObject failed.", "clEnqueueUnmapMemObject");
 }
 
+#ifdef QUICKSORT_FILE
+// quicksort-file: sorts a raw binary file in place. The file is memory mapped and the mapping
+// becomes the d buffer of GPUQSort (CL_MEM_USE_HOST_PTR), so on CPU devices the data is never
+// read into a temporary array nor written back from one.
+int main(int argc, char** argv)
+{
+	OCLResources	myOCL;
+	memset(&myOCL, 0, sizeof(OCLResources));
+	char			pDeviceStr[256] = "gpu";
+	char			pVendorStr[256] = "intel";
+	const char*		pSourceFileStr	= "QuicksortKernels.cl";
+	const char sUsageString[512] = "Usage: quicksort-file <file> <uint> [cpu|gpu] [intel|amd|nvidia]\n       quicksort-file --generate <num elements> <file> <uint>";
+
+	double totalTime;
+
+	double beginClock, endClock;
+
+	if (argc == 5 && std::string(argv[1]) == "--generate") {
+		// random input to try it out
+		size_t size = strtoull(argv[2], NULL, 10);
+		FILE* fp = fopen(argv[3], "wb");
+		if (!fp || std::string(argv[4]) != "uint")
+			Cleanup (&myOCL, -1, true, sUsageString);
+		std::vector<uint> buf(1 << 20);
+		srand((unsigned)size);
+		for(size_t i = 0; i < size; i += buf.size()) {
+			size_t n = std::min(buf.size(), size - i);
+			std::generate(buf.begin(), buf.begin() + n, [](){ return (uint)rand() << 16 ^ (uint)rand(); });
+			fwrite(&buf[0], sizeof(uint), n, fp);
+		}
+		fclose(fp);
+		return 0;
+	}
+	if (argc < 3 || argc > 5)
+		Cleanup (&myOCL, -1, true, sUsageString);
+	// the kernels in QuicksortKernels.cl are written for uint only
+	if (std::string(argv[2]) != "uint")
+		Cleanup (&myOCL, -1, true, "quicksort-file: this sample sorts uint files only");
+	if (argc > 3)
+		sprintf (pDeviceStr, "%s", argv[3]);
+	if (argc > 4)
+		sprintf (pVendorStr, "%s", argv[4]);
+
+	MappedFile file;
+	if (!MapFile(argv[1], &file))
+		Cleanup (&myOCL, -1, true, "quicksort-file: failed to map the file");
+	uint* pArray = (uint*)file.pData;
+	size_t arraySize = file.fileSize/sizeof(uint);
+	// GPUQSort indexes with uint
+	if (file.fileSize/sizeof(uint) > UINT_MAX) {
+		UnmapFile(&file);
+		Cleanup (&myOCL, -1, true, "quicksort-file: the file has more than UINT_MAX elements");
+	}
+	printf("Sorting %s: %llu elements\n", argv[1], (unsigned long long)arraySize);
+
+	// Initialize OpenCL:
+	bool bCPUDevice;
+	InitializeOpenCL (pDeviceStr, pVendorStr, &myOCL.deviceID, &myOCL.contextHdl, &myOCL.cmdQHdl, bCPUDevice);
+  beginClock = seconds();
+	CompileOpenCLProgram (bCPUDevice, myOCL.deviceID, myOCL.contextHdl, pSourceFileStr, &myOCL.programHdl);
+  endClock = seconds();
+	totalTime = endClock - beginClock;
+	std::cout << "Time to build OpenCL Program: " << totalTime * 1000 << " ms" << std::endl;
+	if (arraySize > 1) {
+		const size_t MAXSEQ = optp(arraySize, 0.00009516, 203);
+		const size_t MAX_SIZE = 12*std::max(int(MAXSEQ), QUICKSORT_BLOCK_SIZE);
+#ifdef _MSC_VER 
+		work_record* pdone = (work_record*)_aligned_malloc (((MAX_SIZE*sizeof(work_record))/64 + 1)*64, 4096);
+		work_record* pnews = (work_record*)_aligned_malloc (((MAX_SIZE*sizeof(work_record))/64 + 1)*64, 4096);
+#else // _MSC_VER
+		work_record* pdone = (work_record*)aligned_alloc (4096, ((MAX_SIZE*sizeof(work_record))/64 + 1)*64);
+		work_record* pnews = (work_record*)aligned_alloc (4096, ((MAX_SIZE*sizeof(work_record))/64 + 1)*64);
+#endif // _MSC_VER
+		InstantiateOpenCLKernels (&myOCL, arraySize, MAXSEQ, MAX_SIZE, pdone, pnews, pArray);
+
+		beginClock = seconds();
+		GPUQSort(&myOCL, arraySize, pArray, pdone, pnews, MAX_SIZE);
+		endClock = seconds();
+		totalTime = endClock - beginClock;
+		std::cout << "Time to sort: " << totalTime * 1000 << " ms" << std::endl;
+
+		// the d buffer must be gone before the mapping
+		Cleanup(&myOCL, 0, 0, NULL);
+#ifdef _MSC_VER
+		_aligned_free(pnews);
+		_aligned_free(pdone);
+#else // _MSC_VER
+		free(pnews);
+		free(pdone);
+#endif // _MSC_VER
+	}
+#ifdef TRUST_BUT_VERIFY
+	bool correct = std::is_sorted(pArray, pArray + arraySize);
+	std::cout << "verifying: " << std::boolalpha << correct << std::endl;
+#else
+	bool correct = true;
+#endif
+
+	beginClock = seconds();
+	if (!UnmapFile(&file))
+		Cleanup (&myOCL, -1, true, "quicksort-file: failed to write the file back");
+	endClock = seconds();
+	std::cout << "Time to unmap: " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+
+	Cleanup(&myOCL, 0, 0, "-------done--------------------------------------------------------\n");
+	return correct ? 0 : 1;
+}
+#else // QUICKSORT_FILE
 int main(int argc, char** argv)
 {
 	OCLResources	myOCL;
@@ -516,3 +625,4 @@ int main(int argc, char** argv)
 
 	return 0;
 }
+#endif // QUICKSORT_FILE
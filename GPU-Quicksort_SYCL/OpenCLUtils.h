@@ -34,7 +34,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <assert.h>
 #include <string>
+#include <string.h>
 #include <CL/cl.h>
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 // Util for error checking:
 //#undef __OCL_NO_ERROR_CHECKING
@@ -160,4 +166,7 @@ void CompileOpenCLProgram(bool bCPUDevice, cl_device_id oclDeviceID, cl_context
 	*pOclProgramHdl = oclProgramHdl;
 }
 
+// Util for sorting files in place through a memory mapping:
+#include "../GPU-Quicksort_Common/MappedFile.h"
+
 #endif
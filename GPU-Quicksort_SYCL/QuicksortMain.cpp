@@ -46,13 +46,21 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 #include "OpenCLUtils.h"
 #include <math.h>
+#include <limits.h>
 #include <iostream>
 #include <algorithm>
 #include <iterator>
 #include <vector>
 #include <map>
+#include <memory>
+#include <functional>
+#include <utility>
 
 #include "tbb/parallel_sort.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/parallel_scan.h"
+#include "tbb/blocked_range.h"
 using namespace cl::sycl;
 
 /* Classes can inherit from the device_selector class to allow users
@@ -140,31 +148,10 @@ void Cleanup(OCLResources* pOCL, int iExitCode, bool bExit, const char* optional
 		exit (iExitCode);
 }
 
-void parseArgs(OCLResources* pOCL, int argc, char** argv, unsigned int* test_iterations, char* pDeviceStr, char* pVendorStr, unsigned int* widthReSz, unsigned int* heightReSz, bool* pbShowCL)
-{	
-  std::string pDeviceWStr;
-  std::string pVendorWStr;
-  const char sUsageString[512] = "Usage: Quicksort [num test iterations] [cpu|gpu] [intel|amd|nvidia] [SurfWidth(^2 only)] [SurfHeight(^2 only)] [show_CL | no_show_CL]";
-  
-  if (argc != 7)
-  {
-  	Cleanup (pOCL, -1, true, sUsageString);
-  }
-  else
-  {
-  	*test_iterations	= atoi (argv[1]);
-  	pDeviceWStr			= std::string(argv[2]);			// "cpu" or "gpu"	
-  	pVendorWStr			= std::string(argv[3]);			// "intel" or "amd" or "nvidia"
-  	*widthReSz	= atoi (argv[4]);
-  	*heightReSz	= atoi (argv[5]);
-  	if (argv[6][0]=='s')
-  		*pbShowCL = true;
-  	else
-  		*pbShowCL = false;
-  }
-  sprintf (pDeviceStr, "%s", pDeviceWStr.c_str());
-  sprintf (pVendorStr, "%s", pVendorWStr.c_str());
-
+// Creates the queue for the device selected by pDeviceStr ("cpu" or "gpu") and pVendorStr
+// ("intel" or anything else for the default device) and retrieves its OpenCL handles.
+void InitOCLResources(OCLResources* pOCL, const char* pDeviceStr, const char* pVendorStr)
+{
   auto get_queue = [&pDeviceStr, &pVendorStr]() {  
     device_selector* pds;
     if (pVendorStr == std::string("intel")) {
@@ -208,6 +195,34 @@ void parseArgs(OCLResources* pOCL, int argc, char** argv, unsigned int* test_ite
   pOCL->cmdQHdl = queue.get();
 }
 
+void parseArgs(OCLResources* pOCL, int argc, char** argv, unsigned int* test_iterations, char* pDeviceStr, char* pVendorStr, unsigned int* widthReSz, unsigned int* heightReSz, bool* pbShowCL)
+{	
+  std::string pDeviceWStr;
+  std::string pVendorWStr;
+  const char sUsageString[512] = "Usage: Quicksort [num test iterations] [cpu|gpu] [intel|amd|nvidia] [SurfWidth(^2 only)] [SurfHeight(^2 only)] [show_CL | no_show_CL]";
+  
+  if (argc != 7)
+  {
+  	Cleanup (pOCL, -1, true, sUsageString);
+  }
+  else
+  {
+  	*test_iterations	= atoi (argv[1]);
+  	pDeviceWStr			= std::string(argv[2]);			// "cpu" or "gpu"	
+  	pVendorWStr			= std::string(argv[3]);			// "intel" or "amd" or "nvidia"
+  	*widthReSz	= atoi (argv[4]);
+  	*heightReSz	= atoi (argv[5]);
+  	if (argv[6][0]=='s')
+  		*pbShowCL = true;
+  	else
+  		*pbShowCL = false;
+  }
+  sprintf (pDeviceStr, "%s", pDeviceWStr.c_str());
+  sprintf (pVendorStr, "%s", pVendorWStr.c_str());
+
+  InitOCLResources(pOCL, pDeviceStr, pVendorStr);
+}
+
 void InstantiateOpenCLKernels(OCLResources *pOCL)
 {	
 	// Instantiate kernels:
@@ -223,6 +238,53 @@ void InstantiateOpenCLKernels(OCLResources *pOCL)
 #define HOST 1
 #include "Quicksort.h"
 
+// Device record buffers that the gqsort passes and lqsort of a sort reuse: a buffer is only
+// replaced, by one twice as large as needed, when a pass needs more records than it holds.
+// The records are copied in and out explicitly, instead of through use_host_ptr buffers
+// created and destroyed on every pass.
+template <class R>
+class record_buffer {
+public:
+	record_buffer() : capacity(0) {}
+
+	buffer<R>& reserve(size_t count) {
+		if (!records || count > capacity) {
+			capacity = std::max(std::max(count, 2*capacity), (size_t)1);
+			records.reset(new buffer<R>(range<1>(capacity)));
+		}
+		return *records;
+	}
+
+	void copy_from_host(queue& q, const R* host, size_t count) {
+		buffer<R>& b = reserve(count);
+		if (count == 0)
+			return;
+		q.submit([&](handler& cgh) {
+			auto acc = b.template get_access<access::mode::discard_write>(cgh, range<1>(count));
+			cgh.copy(host, acc);
+		});
+	}
+
+	void copy_to_host(queue& q, R* host, size_t count) {
+		if (count == 0)
+			return;
+		q.submit([&](handler& cgh) {
+			auto acc = records->template get_access<access::mode::read>(cgh, range<1>(count));
+			cgh.copy(acc, host);
+		});
+	}
+
+private:
+	std::unique_ptr<buffer<R>> records;
+	size_t capacity;
+};
+
+struct record_buffers {
+	record_buffer<block_record> blocks;
+	record_buffer<parent_record> parents;
+	record_buffer<work_record> news, done;
+};
+
 
 template <class T>
 T* partition(T* left, T* right, T pivot) {
@@ -273,7 +335,7 @@ void quicksort(T* data, int left, int right)
 }
 
 template <class T>
-void gqsort(OCLResources *pOCL, buffer<T>& d_buffer, buffer<T>& dn_buffer, std::vector<block_record>& blocks, std::vector<parent_record>& parents, std::vector<work_record>& news, bool reset) {
+void gqsort(OCLResources *pOCL, buffer<T>& d_buffer, buffer<T>& dn_buffer, std::vector<block_record>& blocks, std::vector<parent_record>& parents, std::vector<work_record>& news, record_buffers& records, bool reset) {
 #ifdef GET_DETAILED_PERFORMANCE
 	static double absoluteTotal = 0.0;
 	static uint count = 0;
@@ -288,10 +350,14 @@ void gqsort(OCLResources *pOCL, buffer<T>& d_buffer, buffer<T>& dn_buffer, std::
 #endif
 
 	news.resize(blocks.size()*2);
-	// Create buffer objects for memory.
-	buffer<block_record>  blocks_buffer(blocks.data(), blocks.size(), {property::buffer::use_host_ptr()});
-	buffer<parent_record>  parents_buffer(parents.data(), parents.size(), {property::buffer::use_host_ptr()});
-	buffer<work_record>  news_buffer(news.data(), news.size(), {property::buffer::use_host_ptr()});
+	// Copy the records into the record buffers of the sort: news is all empty records, as the
+	// kernel only writes the records of the parents it is done with.
+	records.blocks.copy_from_host(pOCL->queue, blocks.data(), blocks.size());
+	records.parents.copy_from_host(pOCL->queue, parents.data(), parents.size());
+	records.news.copy_from_host(pOCL->queue, news.data(), news.size());
+	buffer<block_record>&  blocks_buffer = records.blocks.reserve(blocks.size());
+	buffer<parent_record>&  parents_buffer = records.parents.reserve(parents.size());
+	buffer<work_record>&  news_buffer = records.news.reserve(news.size());
     kernel sycl_gqsort_kernel(gqsort_kernel, pOCL->contextHdl);
 
     pOCL->queue.submit([&](handler& cgh) {
@@ -309,6 +375,7 @@ void gqsort(OCLResources *pOCL, buffer<T>& d_buffer, buffer<T>& dn_buffer, std::
 	                              GQSORT_LOCAL_WORKGROUP_SIZE), 
 	    sycl_gqsort_kernel);
     });
+    records.news.copy_to_host(pOCL->queue, news.data(), news.size());
     pOCL->queue.wait_and_throw();
 
 #ifdef GET_DETAILED_PERFORMANCE
@@ -320,13 +387,14 @@ void gqsort(OCLResources *pOCL, buffer<T>& d_buffer, buffer<T>& dn_buffer, std::
 }
 
 template <class T>
-void lqsort(OCLResources *pOCL, std::vector<work_record>& done, buffer<T>& d_buffer, buffer<T>& dn_buffer) {
+void lqsort(OCLResources *pOCL, std::vector<work_record>& done, buffer<T>& d_buffer, buffer<T>& dn_buffer, record_buffers& records) {
 #ifdef GET_DETAILED_PERFORMANCE
     double beginClock, endClock;
     beginClock = seconds();
 #endif
 
-	buffer<work_record>  done_buffer(done.data(), done.size(), {property::buffer::use_host_ptr()});
+	records.done.copy_from_host(pOCL->queue, done.data(), done.size());
+	buffer<work_record>&  done_buffer = records.done.reserve(done.size());
     kernel sycl_lqsort_kernel(lqsort_kernel, pOCL->contextHdl);
 
     pOCL->queue.submit([&](handler& cgh) {
@@ -354,6 +422,78 @@ size_t optp(size_t s, double k, size_t m) {
 	return (size_t)pow(2, floor(log(s*k + m)/log(2.0) + 0.5));
 }
 
+// Builds the parent and block records of a gqsort pass from the work records. Every work record
+// is cut into blocks of blocksize elements: a parallel prefix sum over the block counts of the
+// work records gives each of them the place of its blocks, so they are all built in parallel.
+template <class W, class P, class B>
+void make_block_records(const W& work, size_t MAXSEQ, P& parent_records, B& blocks) {
+	typedef typename P::value_type parent_type;
+	typedef typename B::value_type block_type;
+	const size_t blocksize = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, work.size()), (size_t)0, 
+		[&](const tbb::blocked_range<size_t>& r, size_t sum) {
+			for(size_t i = r.begin(); i != r.end(); ++i)
+				sum += std::max((work[i].end - work[i].start)/MAXSEQ, (size_t)1);
+			return sum;
+		}, std::plus<size_t>());
+	// first[i] is the index of the first block of work[i]
+	std::vector<size_t> first(work.size() + 1);
+	first[work.size()] = tbb::parallel_scan(tbb::blocked_range<size_t>(0, work.size()), (size_t)0, 
+		[&](const tbb::blocked_range<size_t>& r, size_t sum, bool is_final_scan) {
+			for(size_t i = r.begin(); i != r.end(); ++i) {
+				if (is_final_scan)
+					first[i] = sum;
+				sum += (work[i].end - work[i].start + blocksize - 1)/blocksize;
+			}
+			return sum;
+		}, std::plus<size_t>());
+	parent_records.resize(work.size());
+	blocks.resize(first[work.size()]);
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, work.size()), [&](const tbb::blocked_range<size_t>& r) {
+		for(size_t w = r.begin(); w != r.end(); ++w) {
+			uint start = work[w].start;
+			uint end   = work[w].end;
+			uint direction = work[w].direction;
+			uint blockcount = (uint)(first[w+1] - first[w]);
+			parent_records[w] = parent_type(start, end, start, end, blockcount-1);
+
+			for(uint i = 0; i < blockcount - 1; i++) {
+				uint bstart = start + blocksize*i;
+				blocks[first[w] + i] = block_type(bstart, bstart+blocksize, work[w].pivot, direction, (uint)w);
+			}
+			blocks[first[w] + blockcount - 1] = block_type(start + blocksize*(blockcount - 1), end, work[w].pivot, direction, (uint)w);
+		}
+	});
+}
+
+// Sorts the new records of a gqsort pass into work, the ones still too long for lqsort, and done.
+// A parallel prefix sum over both counts gives every record its place, so the order is kept.
+template <class N, class W, class D>
+void split_new_records(const N& news, W& work, D& done) {
+	typedef std::pair<size_t, size_t> counts; // work records, done records
+	const size_t done_size = done.size();
+	work.resize(news.size());
+	done.resize(done_size + news.size());
+	counts total = tbb::parallel_scan(tbb::blocked_range<size_t>(0, news.size()), counts(0, 0), 
+		[&](const tbb::blocked_range<size_t>& r, counts sum, bool is_final_scan) {
+			for(size_t i = r.begin(); i != r.end(); ++i) {
+				if (news[i].direction == EMPTY_RECORD || news[i].end == news[i].start)
+					continue;
+				if (news[i].end - news[i].start <= QUICKSORT_BLOCK_SIZE /*size/MAXSEQ*/) {
+					if (is_final_scan)
+						done[done_size + sum.second] = news[i];
+					sum.second++;
+				} else {
+					if (is_final_scan)
+						work[sum.first] = news[i];
+					sum.first++;
+				}
+			}
+			return sum;
+		}, [](const counts& a, const counts& b) { return counts(a.first + b.first, a.second + b.second); });
+	work.resize(total.first);
+	done.resize(done_size + total.second);
+}
+
 template <class T>
 void GPUQSort(OCLResources *pOCL, size_t size, T* d, T* dn)  {
 	// allocate buffers
@@ -372,51 +512,22 @@ void GPUQSort(OCLResources *pOCL, size_t size, T* d, T* dn)  {
 	parent_records.reserve(MAX_SIZE);
 	std::vector<block_record> blocks;
 	blocks.reserve(MAX_SIZE);
+	// device copies of the records, reused by all the passes
+	record_buffers records;
 	
 	work.push_back(work_record(0, size, startpivot, 1));
 
 	bool reset = true;
 
 	while(!work.empty() /*&& work.size() + done.size() < MAXSEQ*/) {
-		size_t blocksize = 0;
-		
-		for(auto it = work.begin(); it != work.end(); ++it) {
-			blocksize += std::max((it->end - it->start)/MAXSEQ, (size_t)1);
-		}
-		for(auto it = work.begin(); it != work.end(); ++it) {
-			uint start = it->start;
-			uint end   = it->end;
-			uint pivot = it->pivot;
-			uint direction = it->direction;
-			uint blockcount = (end - start + blocksize - 1)/blocksize;
-			parent_record prnt(start, end, start, end, blockcount-1);
-			parent_records.push_back(prnt);
-
-			for(uint i = 0; i < blockcount - 1; i++) {
-				uint bstart = start + blocksize*i;
-				block_record br(bstart, bstart+blocksize, pivot, direction, parent_records.size()-1);
-				blocks.push_back(br);
-			}
-			block_record br(start + blocksize*(blockcount - 1), end, pivot, direction, parent_records.size()-1);
-			blocks.push_back(br);
-		}
+		make_block_records(work, MAXSEQ, parent_records, blocks);
 
-		gqsort(pOCL, d_buffer, dn_buffer, blocks, parent_records, news, reset);
+		gqsort(pOCL, d_buffer, dn_buffer, blocks, parent_records, news, records, reset);
 		reset = false;
 		//std::cout << " blocks = " << blocks.size() << " parent records = " << parent_records.size() << " news = " << news.size() << std::endl;
-		work.clear();
 		parent_records.clear();
 		blocks.clear();
-		for(auto it = news.begin(); it != news.end(); ++it) {
-			if (it->direction != EMPTY_RECORD) {
-				if (it->end - it->start <= QUICKSORT_BLOCK_SIZE /*size/MAXSEQ*/) {
-					if (it->end - it->start > 0)
-						done.push_back(*it);
-				} else {
-					work.push_back(*it);
-				}
-			}
-		}
+		split_new_records(news, work, done);
 		news.clear();
 	}
 	for(auto it = work.begin(); it != work.end(); ++it) {
@@ -424,7 +535,7 @@ void GPUQSort(OCLResources *pOCL, size_t size, T* d, T* dn)  {
 			done.push_back(*it);
 	}
 
-	lqsort(pOCL, done, d_buffer, dn_buffer);
+	lqsort(pOCL, done, d_buffer, dn_buffer, records);
 }
 
 void QueryPrintDeviceInfo(queue& q) {
@@ -476,6 +587,104 @@ void QueryPrintDeviceInfo(queue& q) {
 	CheckCLError (ciErrNum, "clGetSupportedImageFormats() query failed.", "clGetSupportedImageFormats() query success")
 }
 
+#ifdef QUICKSORT_FILE
+// quicksort-file: sorts a raw binary file in place. The file is memory mapped and the mapping
+// becomes the d buffer of GPUQSort (use_host_ptr), so on CPU devices the data is never
+// read into a temporary array nor written back from one.
+int main(int argc, char** argv)
+{
+	OCLResources	myOCL;
+	char			pDeviceStr[256] = "gpu";
+	char			pVendorStr[256] = "intel";
+	const char*		pSourceFileStr	= "QuicksortKernels.cl";
+	const char sUsageString[512] = "Usage: quicksort-file <file> <uint> [cpu|gpu] [intel|amd|nvidia]\n       quicksort-file --generate <num elements> <file> <uint>";
+
+	double totalTime;
+
+	double beginClock, endClock;
+
+	if (argc == 5 && std::string(argv[1]) == "--generate") {
+		// random input to try it out
+		size_t size = strtoull(argv[2], NULL, 10);
+		FILE* fp = fopen(argv[3], "wb");
+		if (!fp || std::string(argv[4]) != "uint")
+			Cleanup (&myOCL, -1, true, sUsageString);
+		std::vector<uint> buf(1 << 20);
+		srand((unsigned)size);
+		for(size_t i = 0; i < size; i += buf.size()) {
+			size_t n = std::min(buf.size(), size - i);
+			std::generate(buf.begin(), buf.begin() + n, [](){ return (uint)rand() << 16 ^ (uint)rand(); });
+			fwrite(&buf[0], sizeof(uint), n, fp);
+		}
+		fclose(fp);
+		return 0;
+	}
+	if (argc < 3 || argc > 5)
+		Cleanup (&myOCL, -1, true, sUsageString);
+	// the kernels in QuicksortKernels.cl are written for uint only
+	if (std::string(argv[2]) != "uint")
+		Cleanup (&myOCL, -1, true, "quicksort-file: this sample sorts uint files only");
+	if (argc > 3)
+		sprintf (pDeviceStr, "%s", argv[3]);
+	if (argc > 4)
+		sprintf (pVendorStr, "%s", argv[4]);
+
+	MappedFile file;
+	if (!MapFile(argv[1], &file))
+		Cleanup (&myOCL, -1, true, "quicksort-file: failed to map the file");
+	uint* pArray = (uint*)file.pData;
+	size_t arraySize = file.fileSize/sizeof(uint);
+	// GPUQSort indexes with uint
+	if (file.fileSize/sizeof(uint) > UINT_MAX) {
+		UnmapFile(&file);
+		Cleanup (&myOCL, -1, true, "quicksort-file: the file has more than UINT_MAX elements");
+	}
+	printf("Sorting %s: %llu elements\n", argv[1], (unsigned long long)arraySize);
+
+	// Initialize OpenCL:
+	bool bCPUDevice = false;
+	InitOCLResources (&myOCL, pDeviceStr, pVendorStr);
+  beginClock = seconds();
+	CompileOpenCLProgram (bCPUDevice, myOCL.deviceID, myOCL.contextHdl, pSourceFileStr, &myOCL.programHdl);
+  endClock = seconds();
+	totalTime = endClock - beginClock;
+	std::cout << "Time to build OpenCL Program: " << totalTime * 1000 << " ms" << std::endl;
+	InstantiateOpenCLKernels (&myOCL);
+
+	if (arraySize > 1) {
+#ifdef _MSC_VER 
+		uint* pArrayCopy = (uint*)_aligned_malloc (((arraySize*sizeof(uint))/64 + 1)*64, 4096);
+#else // _MSC_VER
+		uint* pArrayCopy = (uint*)aligned_alloc (4096, ((arraySize*sizeof(uint))/64 + 1)*64);
+#endif // _MSC_VER
+		beginClock = seconds();
+		GPUQSort(&myOCL, arraySize, pArray, pArrayCopy);
+		endClock = seconds();
+		totalTime = endClock - beginClock;
+		std::cout << "Time to sort: " << totalTime * 1000 << " ms" << std::endl;
+#ifdef _MSC_VER
+		_aligned_free(pArrayCopy);
+#else // _MSC_VER
+		free(pArrayCopy);
+#endif // _MSC_VER
+	}
+#ifdef TRUST_BUT_VERIFY
+	bool correct = std::is_sorted(pArray, pArray + arraySize);
+	std::cout << "verifying: " << std::boolalpha << correct << std::endl;
+#else
+	bool correct = true;
+#endif
+
+	beginClock = seconds();
+	if (!UnmapFile(&file))
+		Cleanup (&myOCL, -1, true, "quicksort-file: failed to write the file back");
+	endClock = seconds();
+	std::cout << "Time to unmap: " << (endClock - beginClock) * 1000 << " ms" << std::endl;
+
+	printf("-------done--------------------------------------------------------\n");
+	return correct ? 0 : 1;
+}
+#else // QUICKSORT_FILE
 int main(int argc, char** argv)
 {
 	OCLResources	myOCL;
@@ -643,3 +852,4 @@ int main(int argc, char** argv)
 
 	return 0;
 }
+#endif // QUICKSORT_FILE